@@ -0,0 +1,337 @@
+// Micro-benchmarks for the hot paths in bmusb.cpp, which is included
+// directly so that we can get at its internals. Build with "make bench".
+//
+// The copy benchmark fills frames from the pool in packet-sized pieces,
+// with memcpy() and with memcpy_streaming(), for 720p and 1080p frames.
+// Besides throughput, it measures how long it takes to read back a small
+// working set after each frame (which is what the non-temporal stores are
+// there to leave in the cache), and counts LLC misses if the kernel lets us.
+//
+// The decode benchmark runs decode_packs() on synthetic video (8-bit and
+// v210) and audio transfers, and reports cycles (or, without perf
+// counters, nanoseconds) per byte. Video is run both locked to the frame
+// length, as in steady-state capture, and searching for every sync
+// pattern, as before the length is confirmed.
+//
+// Before any of that, it checks a few corner cases of the internals that
+// nothing else can get at, and exits with an error if one of them fails.
+
+#include "bmusb.cpp"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include <vector>
+
+using namespace bmusb;
+
+namespace {
+
+// A hardware counter for the calling thread, or nothing if perf events
+// are not available (in which case read() returns -1).
+class PerfCounter {
+public:
+	explicit PerfCounter(uint64_t config)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	~PerfCounter()
+	{
+		if (fd != -1) close(fd);
+	}
+
+	int64_t read() const
+	{
+		int64_t value;
+		if (fd == -1 || ::read(fd, &value, sizeof(value)) != sizeof(value)) {
+			return -1;
+		}
+		return value;
+	}
+
+private:
+	int fd;
+};
+
+int64_t now_ns()
+{
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Something in the video range, like the card would send; never 0xff.
+void fill_pixels(uint8_t *data, size_t len, unsigned seed)
+{
+	for (size_t i = 0; i < len; ++i) {
+		data[i] = 0x10 + ((seed * 7 + i * 13 + (i >> 9)) % 0xd0);
+	}
+}
+
+// v210, ie., three 10-bit samples in the low 30 bits of each little-endian
+// word. The samples are spread over the whole legal range (4..1019), so
+// about one byte in 256 is 0xff (0x0ff, 0x1ff and 0x2ff are all legal),
+// which the unlocked scanner has to check and reject.
+void fill_v210(uint8_t *data, size_t len, unsigned seed)
+{
+	uint32_t state = seed * 2654435761u + 1;
+	for (size_t i = 0; i + 4 <= len; i += 4) {
+		uint32_t word = 0;
+		for (int j = 0; j < 3; ++j) {
+			state = state * 1664525 + 1013904223;
+			word |= (4 + (state >> 16) % 1016) << (10 * j);
+		}
+		data[i + 0] = word;
+		data[i + 1] = word >> 8;
+		data[i + 2] = word >> 16;
+		data[i + 3] = word >> 24;
+	}
+}
+
+void bench_copy(const char *name, size_t frame_bytes, bool streaming)
+{
+	constexpr int num_frames = 64;
+	constexpr int num_pool_frames = NUM_INITIAL_VIDEO_FRAMES;
+	constexpr size_t working_set_bytes = 1 << 20;
+	const size_t packet_bytes = find_xfer_size_for_width(PixelFormat_8BitYCbCr, 1920);
+
+	// The source stands in for the transfer buffers; a few frames' worth,
+	// so that it does not all stay in the cache.
+	vector<uint8_t> src(4 * frame_bytes);
+	fill_pixels(src.data(), src.size(), 1);
+	vector<unique_ptr<uint8_t[]>> pool;
+	for (int i = 0; i < num_pool_frames; ++i) {
+		pool.emplace_back(new uint8_t[frame_bytes]);
+		memset(pool.back().get(), 0, frame_bytes);
+	}
+	vector<uint8_t> working_set(working_set_bytes, 1);
+
+	PerfCounter llc_misses(PERF_COUNT_HW_CACHE_MISSES);
+	int64_t copy_ns = 0, read_ns = 0;
+	int64_t misses_before = llc_misses.read();
+	volatile unsigned sum = 0;
+	for (int frame = 0; frame < num_frames; ++frame) {
+		// Read the working set once so that it is warm, the way
+		// everybody else's data would be.
+		for (size_t i = 0; i < working_set_bytes; i += 64) sum += working_set[i];
+
+		uint8_t *dest = pool[frame % num_pool_frames].get();
+		const uint8_t *from = &src[(frame % 4) * frame_bytes];
+		int64_t start = now_ns();
+		for (size_t offset = 0; offset < frame_bytes; offset += packet_bytes) {
+			size_t bytes = min(packet_bytes, frame_bytes - offset);
+			if (streaming) {
+				memcpy_streaming(dest + offset, from + offset, bytes);
+			} else {
+				memcpy(dest + offset, from + offset, bytes);
+			}
+		}
+		if (streaming) {
+			streaming_store_fence();
+		}
+		int64_t copied = now_ns();
+		for (size_t i = 0; i < working_set_bytes; i += 64) sum += working_set[i];
+		int64_t read = now_ns();
+
+		copy_ns += copied - start;
+		read_ns += read - copied;
+	}
+	int64_t misses_after = llc_misses.read();
+
+	printf("copy %-5s %-16s %6.2f GB/s, working set read back in %6.1f us",
+		name, streaming ? "memcpy_streaming" : "memcpy",
+		double(frame_bytes) * num_frames / copy_ns, read_ns * 1e-3 / num_frames);
+	if (misses_before >= 0 && misses_after >= 0) {
+		printf(", %8.0f LLC misses/frame", double(misses_after - misses_before) / num_frames);
+	}
+	printf("\n");
+}
+
+// A stream of frames (or audio blocks) with sync patterns, to be cut up
+// into transfers.
+vector<uint8_t> make_stream(const char *sync_pattern, size_t sync_length, uint16_t format, size_t frame_bytes, int num_frames, bool v210)
+{
+	vector<uint8_t> stream;
+	for (int frame = 0; frame < num_frames; ++frame) {
+		stream.insert(stream.end(), sync_pattern, sync_pattern + sync_length);
+		size_t start = stream.size();
+		stream.resize(start + frame_bytes);
+		if (v210) {
+			fill_v210(&stream[start], frame_bytes, frame);
+		} else {
+			fill_pixels(&stream[start], frame_bytes, frame);
+		}
+		stream[start + 0] = frame & 0xff;  // Timecode.
+		stream[start + 1] = frame >> 8;
+		stream[start + 2] = format & 0xff;
+		stream[start + 3] = format >> 8;
+	}
+	return stream;
+}
+
+}  // namespace
+
+namespace bmusb {
+
+// A friend of BMUSBCapture, to be able to call decode_packs().
+struct BMUSBCaptureBenchmark {
+	static bool check_backwards_skipped_frame();
+	static void run_decode_benchmarks();
+
+	template<class Endpoint>
+	static void bench_decode(const char *name, const vector<uint8_t> &stream, int packet_size, int num_packets, bool search);
+};
+
+// A skipped (decimated) frame is queued empty, with no owner; if its
+// timecode goes backwards (as after a resync), it must just be dropped.
+bool BMUSBCaptureBenchmark::check_backwards_skipped_frame()
+{
+	MallocFrameAllocator video_allocator(FRAME_SIZE, 1);
+	BMUSBCapture usb(0);
+	usb.set_video_frame_allocator(&video_allocator);
+
+	usb.queue_frame(0xe94b, 0x0005, video_allocator.alloc_frame(), &usb.pending_video_frames);
+	usb.queue_frame(0xe94b, 0x0003, FrameAllocator::Frame(), &usb.pending_video_frames);
+	bool ok = (usb.pending_video_frames.size() == 1 && usb.pending_video_frames.back().timecode == 0x0005);
+
+	for (BMUSBCapture::QueuedFrame &qf : usb.pending_video_frames) {
+		video_allocator.release_frame(qf.frame);
+	}
+	usb.pending_video_frames.clear();
+
+	printf("check backwards skipped frame: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+void BMUSBCaptureBenchmark::run_decode_benchmarks()
+{
+	// 720p50 and 1080p25; without 0x0800, the same modes in 10-bit.
+	for (uint16_t format : { 0xe94b, 0xe86b, 0xe14b, 0xe06b }) {
+		bool v210 = !(format & 0x0800);
+		VideoFormat video_format;
+		decode_video_format(format, &video_format);
+		size_t frame_bytes = HEADER_SIZE + video_format.stride *
+			(video_format.height + video_format.extra_lines_top + video_format.extra_lines_bottom);
+		vector<uint8_t> stream = make_stream(BMUSBCapture::VideoEndpoint::sync_pattern,
+			BMUSBCapture::VideoEndpoint::sync_length, format, frame_bytes, 3, v210);
+		int packet_size = find_xfer_size_for_width(v210 ? PixelFormat_10BitYCbCr : PixelFormat_8BitYCbCr, video_format.width);
+		for (bool search : { false, true }) {
+			char name[64];
+			snprintf(name, sizeof(name), "video %dp %s%s", video_format.height, v210 ? "v210" : "8-bit",
+				search ? " searching" : "");
+			bench_decode<BMUSBCapture::VideoEndpoint>(name, stream, packet_size, (128 << 10) / packet_size, search);
+		}
+	}
+
+	vector<uint8_t> stream = make_stream(BMUSBCapture::AudioEndpoint::sync_pattern,
+		BMUSBCapture::AudioEndpoint::sync_length, 0x8000, AUDIO_HEADER_SIZE + 960 * 24, 16, false);
+	bench_decode<BMUSBCapture::AudioEndpoint>("audio", stream, AUDIO_PACKET_SIZE, 80, false);
+}
+
+template<class Endpoint>
+void BMUSBCaptureBenchmark::bench_decode(const char *name, const vector<uint8_t> &stream, int packet_size, int num_packets, bool search)
+{
+	constexpr int num_transfers = 2000;
+
+	MallocFrameAllocator video_allocator(FRAME_SIZE, NUM_INITIAL_VIDEO_FRAMES);
+	MallocFrameAllocator audio_allocator(65536, NUM_INITIAL_AUDIO_FRAMES);
+	video_allocator.prefault();
+	audio_allocator.prefault();
+
+	BMUSBCapture usb(0);
+	usb.set_video_frame_allocator(&video_allocator);
+	usb.set_audio_frame_allocator(&audio_allocator);
+	usb.current_video_frame = video_allocator.alloc_frame();
+	usb.current_audio_frame = audio_allocator.alloc_frame();
+
+	libusb_transfer *xfr = libusb_alloc_transfer(num_packets);
+	vector<uint8_t> buf(packet_size * num_packets);
+	xfr->buffer = buf.data();
+	xfr->num_iso_packets = num_packets;
+	BMUSBCapture::TransferState xfr_state;
+	xfr_state.card = &usb;
+	xfr_state.xfr = xfr;
+
+	PerfCounter cycles(PERF_COUNT_HW_CPU_CYCLES);
+	int64_t decode_ns = 0, decode_cycles = 0;
+	size_t bytes = 0, pos = 0;
+	for (int i = 0; i < num_transfers; ++i) {
+		for (int j = 0; j < num_packets; ++j) {
+			libusb_iso_packet_descriptor *pack = &xfr->iso_packet_desc[j];
+			pack->status = LIBUSB_TRANSFER_COMPLETED;
+			pack->length = packet_size;
+			pack->actual_length = packet_size;
+			for (int k = 0; k < packet_size; ++k) {
+				buf[j * packet_size + k] = stream[pos];
+				pos = (pos + 1) % stream.size();
+			}
+		}
+
+		// Forget the lock, so that the scanner runs up to the next
+		// sync pattern (after which the rest of the transfer is locked).
+		if (search) {
+			Endpoint::sync(&usb)->locked = false;
+		}
+
+		BMUSBCapture::PacketCounts counts;
+		int64_t start_cycles = cycles.read();
+		int64_t start = now_ns();
+		usb.decode_packs<Endpoint>(&xfr_state, &counts);
+		decode_ns += now_ns() - start;
+		decode_cycles += cycles.read() - start_cycles;
+		bytes += counts.bytes;
+
+		// Stand in for the dequeue thread.
+		lock_guard<mutex> lock(usb.queue_lock);
+		for (BMUSBCapture::QueuedFrame &qf : usb.pending_video_frames) {
+			video_allocator.release_frame(qf.frame);
+		}
+		for (BMUSBCapture::QueuedFrame &qf : usb.pending_audio_frames) {
+			audio_allocator.release_frame(qf.frame);
+		}
+		usb.pending_video_frames.clear();
+		usb.pending_audio_frames.clear();
+	}
+	if (cycles.read() >= 0) {
+		printf("decode %-28s %6.3f cycles/byte, %6.2f GB/s\n", name, double(decode_cycles) / bytes, double(bytes) / decode_ns);
+	} else {
+		printf("decode %-28s %6.3f ns/byte, %6.2f GB/s\n", name, double(decode_ns) / bytes, double(bytes) / decode_ns);
+	}
+
+	video_allocator.release_frame(usb.current_video_frame);
+	audio_allocator.release_frame(usb.current_audio_frame);
+	usb.current_video_frame = FrameAllocator::Frame();
+	usb.current_audio_frame = FrameAllocator::Frame();
+	xfr->buffer = nullptr;
+	libusb_free_transfer(xfr);
+}
+
+}  // namespace bmusb
+
+int main()
+{
+	BMUSBCapture::set_log_level(LogLevel_Warning);
+
+	if (!BMUSBCaptureBenchmark::check_backwards_skipped_frame()) {
+		return 1;
+	}
+
+	for (uint16_t format : { 0xe94b, 0xe86b }) {  // 720p50, 1080p25.
+		VideoFormat video_format;
+		decode_video_format(format, &video_format);
+		size_t frame_bytes = video_format.stride *
+			(video_format.height + video_format.extra_lines_top + video_format.extra_lines_bottom);
+		char name[16];
+		snprintf(name, sizeof(name), "%dp", video_format.height);
+		bench_copy(name, frame_bytes, false);
+		bench_copy(name, frame_bytes, true);
+	}
+
+	BMUSBCaptureBenchmark::run_decode_benchmarks();
+	return 0;
+}
@@ -4,12 +4,10 @@
 // 576p60/720p60/1080i60 works, 1080p60 does not work (firmware limitation)
 // Audio comes out as 8-channel 24-bit raw audio.
 
-//#if (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__)
-//#define HAS_MULTIVERSIONING 0
-//#endif
+#if (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__)
+#define HAS_MULTIVERSIONING 1
+#endif
 
-    
-// --- FIX 1: DISABLE AVX OPTIMIZATIONS ---
 #include <assert.h>
 #include <errno.h>
 #include <libusb.h>
@@ -17,10 +15,16 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <sched.h>
+#include <semaphore.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#if HAS_MULTIVERSIONING
+#include <immintrin.h>
+#endif
 #include "bmusb/bmusb.h"
 
 #include <algorithm>
@@ -33,13 +37,13 @@
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <stack>
 #include <string>
 #include <thread>
 
 using namespace std;
 using namespace std::chrono;
-using namespace std::placeholders;
 
 #define USB_VENDOR_BLACKMAGIC 0x1edb
 #define MIN_WIDTH 640
@@ -48,16 +52,252 @@ using namespace std::placeholders;
 
 #define FRAME_SIZE (8 << 20)  // 8 MB.
 #define USB_VIDEO_TRANSFER_SIZE (128 << 10)  // 128 kB.
+#define AUDIO_PACKET_SIZE 0xc0
+
+// The smallest video packet size set_auto_packet_size() will use.
+// Video transfers have room for enough packets of this size to fill them.
+#define MIN_VIDEO_PACKET_SIZE 1024
+
+// The largest frame the card can send us (1080-line v210).
+#define MAX_VIDEO_FRAME_BYTES (HEADER_SIZE + 5120 * 1125)
+
+// Per zero-copy frame. A 1080-line frame is about 45 transfers,
+// and no more than four spans per transfer with the default packet size.
+#define MAX_ZERO_COPY_SPANS 1024
 
 namespace bmusb {
 
 card_connected_callback_t BMUSBCapture::card_connected_callback = nullptr;
 bool BMUSBCapture::hotplug_existing_devices = false;
+ThreadScheduling BMUSBCapture::shared_usb_thread_scheduling{SCHED_RR, 1, {}};
 
 namespace {
 
 FILE *audiofp;
 
+// Logging (see BMUSBCapture::set_log_callback()). Messages are formatted at
+// the call site, straight into a fixed-size record in a lock-free ring
+// (vsnprintf takes no locks and does no I/O), and the logging thread takes
+// them from there to the callback or stdio. The ring is a bounded
+// multi-producer queue, where each slot has a sequence number saying
+// whether it is free to write (== the position to write) or ready to read
+// (== that position + 1).
+class Logger {
+public:
+	Logger()
+	{
+		for (size_t i = 0; i < RING_SIZE; ++i) {
+			slots[i].seq.store(i, memory_order_relaxed);
+		}
+		sem_init(&messages_sem, 0, 0);
+		log_thread = thread(&Logger::thread_func, this);
+	}
+
+	~Logger()
+	{
+		should_quit = true;
+		sem_post(&messages_sem);
+		log_thread.join();
+		sem_destroy(&messages_sem);
+	}
+
+	bool enabled(LogLevel level) const
+	{
+		return level >= min_level.load(memory_order_relaxed);
+	}
+
+	void log(LogLevel level, unsigned suppressed, const char *fmt, va_list ap)
+	{
+		size_t pos = head.load(memory_order_relaxed);
+		Slot *slot;
+		for ( ;; ) {
+			slot = &slots[pos & (RING_SIZE - 1)];
+			intptr_t diff = intptr_t(slot->seq.load(memory_order_acquire)) - intptr_t(pos);
+			if (diff == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				// Full; the logging thread is not keeping up.
+				lost_messages.fetch_add(1, memory_order_relaxed);
+				return;
+			} else {
+				pos = head.load(memory_order_relaxed);
+			}
+		}
+		slot->level = level;
+		slot->suppressed = suppressed;
+		vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+		slot->seq.store(pos + 1, memory_order_release);
+		sem_post(&messages_sem);
+	}
+
+	void set_callback(log_callback_t new_callback)
+	{
+		lock_guard<mutex> lock(callback_mutex);
+		callback = new_callback;
+	}
+
+	atomic<int> min_level{LogLevel_Debug};
+
+private:
+	void thread_func()
+	{
+		pthread_setname_np(pthread_self(), "bmusb_log");
+		for ( ;; ) {
+			while (sem_wait(&messages_sem) == -1 && errno == EINTR) ;
+			drain();
+			if (should_quit) {
+				return;
+			}
+		}
+	}
+
+	void drain()
+	{
+		char line[sizeof(Slot::text) + 64];
+		for ( ;; ) {
+			Slot *slot = &slots[tail & (RING_SIZE - 1)];
+			if (slot->seq.load(memory_order_acquire) != tail + 1) {
+				break;
+			}
+			LogLevel level = slot->level;
+			if (slot->suppressed == 0) {
+				snprintf(line, sizeof(line), "%s", slot->text);
+			} else {
+				snprintf(line, sizeof(line), "%s (%u more since last message)", slot->text, slot->suppressed);
+			}
+			slot->seq.store(tail + RING_SIZE, memory_order_release);
+			++tail;
+			output(level, line);
+		}
+
+		uint64_t lost = lost_messages.exchange(0, memory_order_relaxed);
+		if (lost > 0) {
+			snprintf(line, sizeof(line), "%lu log messages lost (logging could not keep up)", (unsigned long)lost);
+			output(LogLevel_Warning, line);
+		}
+	}
+
+	void output(LogLevel level, const char *line)
+	{
+		lock_guard<mutex> lock(callback_mutex);
+		if (callback != nullptr) {
+			callback(level, line);
+		} else if (level >= LogLevel_Warning) {
+			fprintf(stderr, "%s\n", line);
+		} else {
+			printf("%s%s\n", (level == LogLevel_Debug) ? "[DEBUG] " : "", line);
+		}
+	}
+
+	static constexpr size_t RING_SIZE = 256;  // Must be a power of two.
+	struct Slot {
+		atomic<size_t> seq;
+		LogLevel level;
+		unsigned suppressed;  // Rate-limited messages since the last one.
+		char text[232];
+	};
+	Slot slots[RING_SIZE];
+	atomic<size_t> head{0};  // Next position to write.
+	size_t tail = 0;  // Next position to read; logging thread only.
+	atomic<uint64_t> lost_messages{0};
+	sem_t messages_sem;  // Posted once for each message.
+	atomic<bool> should_quit{false};
+
+	mutex callback_mutex;  // Protects callback.
+	log_callback_t callback = nullptr;
+
+	thread log_thread;
+};
+
+// Started the first time something is logged (or configured).
+Logger *logger()
+{
+	static Logger logger;
+	return &logger;
+}
+
+void log_message(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_message(LogLevel level, const char *fmt, ...)
+{
+	Logger *l = logger();
+	if (!l->enabled(level)) {
+		return;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	l->log(level, 0, fmt, ap);
+	va_end(ap);
+}
+
+// For messages that can come in floods; typically a static next to the call.
+struct LogRateLimit {
+	atomic<int64_t> last_message_ns{0};
+	atomic<unsigned> suppressed{0};
+};
+
+// Like log_message(), but at most once a second for each <rate_limit>.
+// The others are counted, and the count goes along with the next message.
+void log_rate_limited(LogRateLimit *rate_limit, LogLevel level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void log_rate_limited(LogRateLimit *rate_limit, LogLevel level, const char *fmt, ...)
+{
+	Logger *l = logger();
+	if (!l->enabled(level)) {
+		return;
+	}
+	int64_t now_ns = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+	int64_t last_ns = rate_limit->last_message_ns.load(memory_order_relaxed);
+	if ((last_ns != 0 && now_ns - last_ns < 1000000000) ||
+	    !rate_limit->last_message_ns.compare_exchange_strong(last_ns, now_ns, memory_order_relaxed)) {
+		rate_limit->suppressed.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	l->log(level, rate_limit->suppressed.exchange(0, memory_order_relaxed), fmt, ap);
+	va_end(ap);
+}
+
+// Errors while setting up the card are thrown (see BMUSBError),
+// with the message formatted like for log_message().
+[[noreturn]] void throw_error(BMUSBErrorCode code, int libusb_error, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void throw_error(BMUSBErrorCode code, int libusb_error, const char *fmt, ...)
+{
+	char message[512];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(message, sizeof(message), fmt, ap);
+	va_end(ap);
+	throw BMUSBError(code, libusb_error, message);
+}
+
+// For the calling thread; see BMUSBCapture::set_thread_scheduling().
+// Failure is not fatal.
+void apply_thread_scheduling(const ThreadScheduling &scheduling, const char *thread_name)
+{
+	sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = scheduling.priority;
+	int err = pthread_setschedparam(pthread_self(), scheduling.policy, &param);
+	if (err != 0) {
+		log_message(LogLevel_Warning, "couldn't set scheduling policy %d, priority %d for %s: %s",
+			scheduling.policy, scheduling.priority, thread_name, strerror(err));
+	}
+
+	if (!scheduling.cpus.empty()) {
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		for (int cpu : scheduling.cpus) {
+			CPU_SET(cpu, &cpuset);
+		}
+		err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+		if (err != 0) {
+			log_message(LogLevel_Warning, "couldn't set CPU affinity for %s: %s", thread_name, strerror(err));
+		}
+	}
+}
+
 thread usb_thread;
 atomic<bool> should_quit;
 
@@ -99,18 +339,14 @@ int find_xfer_size_for_width(PixelFormat pixel_format, int width)
     return size;
 }
 
-void change_xfer_size_for_width(PixelFormat pixel_format, int width, libusb_transfer *xfr)
+void change_xfer_packet_size(size_t size, libusb_transfer *xfr)
 {
-	assert(width >= MIN_WIDTH);
-	size_t size = find_xfer_size_for_width(pixel_format, width);
 	int num_iso_pack = xfr->length / size;
 
-    // --- DEBUG ADDITION ---
-    // Only print if we are actually changing the size to avoid spamming
 	if (num_iso_pack != xfr->num_iso_packets || size != xfr->iso_packet_desc[0].length) {
-        printf("[DEBUG] Resizing Transfer: Width=%d, CalcSize=%ld, NumPackets=%d\n", 
-               width, size, num_iso_pack);
-        
+		static LogRateLimit rate_limit;
+		log_rate_limited(&rate_limit, LogLevel_Debug, "Resizing transfer: packet size %zu, %d packets",
+			size, num_iso_pack);
 		xfr->num_iso_packets = num_iso_pack;
 		libusb_set_iso_packet_lengths(xfr, size);
 	}
@@ -142,7 +378,8 @@ bool decode_video_format(uint16_t video_format, VideoFormat *decoded_video_forma
 		return true;
 	}
 	if ((video_format & 0xe000) != 0xe000) {
-		printf("Video format 0x%04x does not appear to be a video format. Assuming 60 Hz.\n", video_format);
+		static LogRateLimit rate_limit;
+		log_rate_limited(&rate_limit, LogLevel_Warning, "Video format 0x%04x does not appear to be a video format. Assuming 60 Hz.", video_format);
 		decoded_video_format->width = 0;
 		decoded_video_format->height = 0;
 		decoded_video_format->stride = 0;
@@ -240,7 +477,8 @@ bool decode_video_format(uint16_t video_format, VideoFormat *decoded_video_forma
     // Instead of lying about 720p, we mark it as 2x2.
     // Shim will recognize this as "Unsupported".
     // We print the hex code so you can add it to the table later if it's valid.
-    printf("Unsupported video format: 0x%04x\n", video_format);
+    static LogRateLimit rate_limit;
+    log_rate_limited(&rate_limit, LogLevel_Warning, "Unsupported video format: 0x%04x", video_format);
     
     decoded_video_format->width = 2; 
     decoded_video_format->height = 2;
@@ -269,6 +507,19 @@ int guess_sample_rate(const VideoFormat &video_format, size_t len, int default_r
 	return default_rate;
 }
 
+void log_startup_stats(const StartupStats &stats)
+{
+	// Short enough to fit in one log message.
+	log_message(LogLevel_Info, "First frame after %.1f ms (pools %.1f, init %.1f, open %.1f, interface %.1f, "
+		"controls %.1f, transfers %.1f, finish %.1f, submit %.1f, header %.1f, frame %.1f; warm-up %.1f)",
+		stats.time_to_first_frame.count() * 1e-6, stats.create_frame_pools.count() * 1e-6,
+		stats.libusb_init.count() * 1e-6, stats.open_card.count() * 1e-6,
+		stats.set_interface.count() * 1e-6, stats.control_transfers.count() * 1e-6,
+		stats.allocate_transfers.count() * 1e-6, stats.finish_configure.count() * 1e-6,
+		stats.submit_transfers.count() * 1e-6, stats.first_header.count() * 1e-6,
+		stats.first_frame.count() * 1e-6, stats.frame_pool_warmup.count() * 1e-6);
+}
+
 }  // namespace
 
 FrameAllocator::~FrameAllocator() {}
@@ -288,7 +539,8 @@ FrameAllocator::Frame MallocFrameAllocator::alloc_frame()
 
 	unique_lock<mutex> lock(freelist_mutex); 
 	if (freelist.empty()) {
-		printf("Frame overrun (no more spare frames of size %ld), dropping frame!\n",
+		static LogRateLimit rate_limit;
+		log_rate_limited(&rate_limit, LogLevel_Warning, "Frame overrun (no more spare frames of size %zu), dropping frame!",
 			frame_size);
 	} else {
 		vf.data = freelist.top().release();
@@ -298,15 +550,364 @@ FrameAllocator::Frame MallocFrameAllocator::alloc_frame()
 	return vf;
 }
 
+void MallocFrameAllocator::prefault()
+{
+	const long page_size = sysconf(_SC_PAGESIZE);
+	unique_lock<mutex> lock(freelist_mutex);
+	stack<unique_ptr<uint8_t[]>> frames;
+	while (!freelist.empty()) {
+		uint8_t *data = freelist.top().get();
+		for (size_t offset = 0; offset < frame_size; offset += page_size) {
+			data[offset] = 0;
+		}
+		frames.push(move(freelist.top()));
+		freelist.pop();
+	}
+	freelist = move(frames);
+}
+
+bool MallocFrameAllocator::add_frames(size_t num_frames, bool prefault)
+{
+	const long page_size = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < num_frames; ++i) {
+		unique_ptr<uint8_t[]> frame(new (nothrow) uint8_t[frame_size]);
+		if (frame == nullptr) {
+			return false;
+		}
+		if (prefault) {
+			for (size_t offset = 0; offset < frame_size; offset += page_size) {
+				frame[offset] = 0;
+			}
+		}
+		unique_lock<mutex> lock(freelist_mutex);
+		freelist.push(move(frame));
+	}
+	return true;
+}
+
 void MallocFrameAllocator::release_frame(Frame frame)
 {
+	if (frame.data == nullptr) {
+		return;
+	}
 	if (frame.overflow > 0) {
-		printf("%d bytes overflow after last (malloc) frame\n", int(frame.overflow));
+		static LogRateLimit rate_limit;
+		log_rate_limited(&rate_limit, LogLevel_Warning, "%d bytes overflow after last (malloc) frame", int(frame.overflow));
 	}
 	unique_lock<mutex> lock(freelist_mutex);
 	freelist.push(unique_ptr<uint8_t[]>(frame.data));
 }
 
+AudioRingBuffer::AudioRingBuffer(size_t capacity)
+	: capacity(1)
+{
+	while (this->capacity < capacity) {
+		this->capacity *= 2;
+	}
+	samples.reset(new int32_t[this->capacity * num_channels]);
+}
+
+void AudioRingBuffer::write(const int32_t *src, size_t num_frames)
+{
+	size_t h = head.load(memory_order_relaxed);
+	size_t space = capacity - (h - tail.load(memory_order_acquire));
+	if (num_frames > space) {
+		dropped_frames.fetch_add(num_frames - space, memory_order_relaxed);
+		num_frames = space;
+	}
+	for (size_t i = 0; i < num_frames; ) {
+		size_t pos = (h + i) & (capacity - 1);
+		size_t n = min(num_frames - i, capacity - pos);
+		memcpy(&samples[pos * num_channels], src + i * num_channels, n * num_channels * sizeof(int32_t));
+		i += n;
+	}
+	head.store(h + num_frames, memory_order_release);
+}
+
+size_t AudioRingBuffer::read(int32_t *dest, size_t max_frames)
+{
+	size_t t = tail.load(memory_order_relaxed);
+	size_t num_frames = min(max_frames, head.load(memory_order_acquire) - t);
+	for (size_t i = 0; i < num_frames; ) {
+		size_t pos = (t + i) & (capacity - 1);
+		size_t n = min(num_frames - i, capacity - pos);
+		memcpy(dest + i * num_channels, &samples[pos * num_channels], n * num_channels * sizeof(int32_t));
+		i += n;
+	}
+	tail.store(t + num_frames, memory_order_release);
+	return num_frames;
+}
+
+size_t copy_from_frame(const FrameAllocator::Frame &frame, size_t offset, uint8_t *dest, size_t len)
+{
+	if (frame.spans == nullptr) {
+		if (frame.data == nullptr || offset >= frame.len) {
+			return 0;
+		}
+		len = min(len, frame.len - offset);
+		memcpy(dest, frame.data + offset, len);
+		return len;
+	}
+
+	size_t copied = 0;
+	for (size_t i = 0; i < frame.num_spans && copied < len; ++i) {
+		const FrameSpan &span = frame.spans[i];
+		if (offset >= span.len) {
+			offset -= span.len;
+			continue;
+		}
+		size_t bytes = min(span.len - offset, len - copied);
+		memcpy(dest + copied, span.data + offset, bytes);
+		copied += bytes;
+		offset = 0;
+	}
+	return copied;
+}
+
+// Used for video if zero-copy is enabled (see set_zero_copy_video()).
+// Instead of memory, each frame gets room for a list of spans, and a list
+// of the transfers that those spans point into, so that they can be
+// resubmitted once the frame is released.
+class BMUSBCapture::ZeroCopyFrameAllocator : public FrameAllocator {
+public:
+	ZeroCopyFrameAllocator(size_t num_queued_frames);
+	Frame alloc_frame() override;
+	void release_frame(Frame frame) override;
+
+	// Called from the USB thread; takes a reference to the transfer
+	// if this is the first part of it that goes into the frame.
+	// <xfr_state> can be nullptr if the data is not from a transfer.
+	void add_to_frame(Frame *current_frame, TransferState *xfr_state, const uint8_t *start, const uint8_t *end);
+
+private:
+	struct Slot {
+		FrameSpan spans[MAX_ZERO_COPY_SPANS];
+		vector<TransferState *> held_xfrs;
+	};
+
+	vector<unique_ptr<Slot>> slots;
+
+	mutex freelist_mutex;
+	stack<Slot *> freelist;
+};
+
+BMUSBCapture::ZeroCopyFrameAllocator::ZeroCopyFrameAllocator(size_t num_queued_frames)
+{
+	for (size_t i = 0; i < num_queued_frames; ++i) {
+		slots.emplace_back(new Slot);
+		slots.back()->held_xfrs.reserve(MAX_ZERO_COPY_SPANS);
+		freelist.push(slots.back().get());
+	}
+}
+
+FrameAllocator::Frame BMUSBCapture::ZeroCopyFrameAllocator::alloc_frame()
+{
+	Frame vf;
+	vf.owner = this;
+
+	unique_lock<mutex> lock(freelist_mutex);
+	if (freelist.empty()) {
+		static LogRateLimit rate_limit;
+		log_rate_limited(&rate_limit, LogLevel_Warning, "Frame overrun (no more spare zero-copy frames), dropping frame!");
+	} else {
+		Slot *slot = freelist.top();
+		freelist.pop();
+		vf.userdata = slot;
+		vf.spans = slot->spans;
+		vf.size = FRAME_SIZE;
+	}
+	return vf;
+}
+
+void BMUSBCapture::ZeroCopyFrameAllocator::release_frame(Frame frame)
+{
+	if (frame.overflow > 0) {
+		static LogRateLimit rate_limit;
+		log_rate_limited(&rate_limit, LogLevel_Warning, "%d bytes overflow after last (zero-copy) frame", int(frame.overflow));
+	}
+	Slot *slot = static_cast<Slot *>(frame.userdata);
+	if (slot == nullptr) {
+		return;
+	}
+	for (TransferState *xfr_state : slot->held_xfrs) {
+		xfr_state->card->release_transfer(xfr_state);
+	}
+	slot->held_xfrs.clear();
+
+	unique_lock<mutex> lock(freelist_mutex);
+	freelist.push(slot);
+}
+
+void BMUSBCapture::ZeroCopyFrameAllocator::add_to_frame(Frame *current_frame, TransferState *xfr_state, const uint8_t *start, const uint8_t *end)
+{
+	if (current_frame->spans == nullptr ||
+	    current_frame->len > current_frame->size ||
+	    start == end) {
+		return;
+	}
+
+	size_t bytes = end - start;
+	Slot *slot = static_cast<Slot *>(current_frame->userdata);
+	FrameSpan *last_span = current_frame->num_spans == 0 ? nullptr : &slot->spans[current_frame->num_spans - 1];
+	bool extends_last_span = (last_span != nullptr && last_span->data + last_span->len == start);
+	if (current_frame->len + bytes > current_frame->size) {
+		current_frame->overflow += current_frame->len + bytes - current_frame->size;
+		current_frame->len = current_frame->size;
+		return;
+	}
+	if (!extends_last_span && current_frame->num_spans == MAX_ZERO_COPY_SPANS) {
+		current_frame->overflow += bytes;
+		return;
+	}
+
+	if (xfr_state != nullptr &&
+	    (slot->held_xfrs.empty() || slot->held_xfrs.back() != xfr_state)) {
+		++xfr_state->refcount;
+		slot->held_xfrs.push_back(xfr_state);
+	}
+	if (extends_last_span) {
+		last_span->len += bytes;
+	} else {
+		slot->spans[current_frame->num_spans++] = FrameSpan{ start, bytes };
+	}
+	current_frame->len += bytes;
+}
+
+// The audio frame allocator if there is an audio ring buffer; the audio
+// frames are then always empty, but consumers still give them back.
+class BMUSBCapture::EmptyFrameAllocator : public FrameAllocator {
+public:
+	Frame alloc_frame() override { return Frame(); }
+	void release_frame(Frame frame) override {}
+};
+
+// Used instead of audio frames if there is an audio ring buffer.
+// Knows the layout of an audio block (AUDIO_HEADER_SIZE bytes of header,
+// then 24-bit little-endian samples for eight interleaved channels),
+// and decodes the samples into the ring as they come in, carrying
+// partial frames over from one packet to the next.
+class BMUSBCapture::AudioBlockDecoder {
+public:
+	explicit AudioBlockDecoder(AudioRingBuffer *ring) : ring(ring) {}
+
+	// Called from the USB thread, with the next part of the current block.
+	void add(const uint8_t *start, const uint8_t *end);
+
+	// Called from the USB thread when the next sync pattern has been found.
+	// Returns the length of the block that just ended (including the
+	// header, like an audio frame would have been), and its format.
+	size_t end_block(uint16_t *format);
+
+private:
+	static constexpr size_t bytes_per_frame = AudioRingBuffer::num_channels * 3;
+	static constexpr size_t frames_per_chunk = 64;
+
+	void decode_frames(const uint8_t *src, size_t num_frames);
+
+	AudioRingBuffer *ring;
+	bool in_block = false;  // Anything before the first sync is discarded.
+	size_t block_len = 0;
+	uint8_t header[AUDIO_HEADER_SIZE];
+	uint8_t carry[bytes_per_frame];
+	size_t carry_len = 0;
+	int32_t decoded[frames_per_chunk * AudioRingBuffer::num_channels];
+};
+
+void BMUSBCapture::AudioBlockDecoder::add(const uint8_t *start, const uint8_t *end)
+{
+	if (!in_block) {
+		return;
+	}
+	if (block_len < AUDIO_HEADER_SIZE) {
+		size_t bytes = min<size_t>(end - start, AUDIO_HEADER_SIZE - block_len);
+		memcpy(header + block_len, start, bytes);
+		block_len += bytes;
+		start += bytes;
+	}
+	block_len += end - start;
+
+	// Finish any frame that was split across packets.
+	if (carry_len > 0) {
+		size_t bytes = min<size_t>(end - start, bytes_per_frame - carry_len);
+		memcpy(carry + carry_len, start, bytes);
+		carry_len += bytes;
+		start += bytes;
+		if (carry_len < bytes_per_frame) {
+			return;
+		}
+		decode_frames(carry, 1);
+		carry_len = 0;
+	}
+
+	size_t num_frames = (end - start) / bytes_per_frame;
+	decode_frames(start, num_frames);
+	start += num_frames * bytes_per_frame;
+
+	carry_len = end - start;
+	memcpy(carry, start, carry_len);
+}
+
+size_t BMUSBCapture::AudioBlockDecoder::end_block(uint16_t *format)
+{
+	size_t len = in_block ? block_len : 0;
+	*format = (len >= AUDIO_HEADER_SIZE) ? (header[3] << 8) | header[2] : 0;
+
+	// A partial frame at the end of the block is dropped.
+	in_block = true;
+	block_len = 0;
+	carry_len = 0;
+	return len;
+}
+
+void BMUSBCapture::AudioBlockDecoder::decode_frames(const uint8_t *src, size_t num_frames)
+{
+	while (num_frames > 0) {
+		size_t n = min(num_frames, frames_per_chunk);
+		for (size_t i = 0; i < n * AudioRingBuffer::num_channels; ++i, src += 3) {
+			decoded[i] = int32_t((uint32_t(src[0]) << 8) | (uint32_t(src[1]) << 16) | (uint32_t(src[2]) << 24));
+		}
+		ring->write(decoded, n);
+		num_frames -= n;
+	}
+}
+
+// Used instead of a plain copy when converting video (see
+// set_output_pixel_format()). Gets the kept parts of each line from
+// FrameCrop::for_each_kept(), along with where in the picture they go,
+// and writes the converted pixels straight into their planes, carrying
+// partial pixel groups over from one packet to the next.
+class BMUSBCapture::FrameConverter {
+public:
+	explicit FrameConverter(OutputPixelFormat format) : format(format) {}
+
+	// Called from the USB thread for each new frame that is to be
+	// converted, after it has been allocated, with its (cropped) format.
+	void start_frame(const VideoFormat &video_format);
+
+	// Called from the USB thread with each part of the frame that
+	// FrameCrop::for_each_kept() gives out (with the same arguments).
+	void add(FrameAllocator::Frame *frame, const uint8_t *start, const uint8_t *end, size_t line, size_t column);
+
+private:
+	// These take whole pixel groups only (ie., <bytes> and <column>
+	// must be multiples of group_bytes), and return the number of
+	// bytes written to the picture.
+	size_t convert(uint8_t *picture, const uint8_t *src, size_t bytes, size_t line, size_t column);
+	size_t convert_uyvy(uint8_t *picture, const uint8_t *src, size_t bytes, size_t line, size_t x);
+
+	// Writes the pixels <x> and <x + 1> on the given line, with 10-bit values.
+	size_t put_pair(uint8_t *picture, size_t line, size_t x, unsigned y0, unsigned y1, unsigned cb, unsigned cr);
+
+	const OutputPixelFormat format;
+	bool ten_bit = false;
+	size_t width = 0, height = 0;
+	size_t group_bytes = 4, group_pixels = 2;  // UYVY; v210 is 16 and 6.
+	size_t chroma_offset[2] = { 0, 0 };  // Of the Cb and Cr planes, from the start of the picture.
+	size_t picture_bytes = 0;
+	uint8_t carry[16];
+	size_t carry_len = 0, carry_line = 0, carry_column = 0;
+};
+
 bool uint16_less_than_with_wraparound(uint16_t a, uint16_t b)
 {
 	if (a == b) {
@@ -323,9 +924,12 @@ void BMUSBCapture::queue_frame(uint16_t format, uint16_t timecode, FrameAllocato
 {
 	unique_lock<mutex> lock(queue_lock);
 	if (!q->empty() && !uint16_less_than_with_wraparound(q->back().timecode, timecode)) {
-		printf("Blocks going backwards: prev=0x%04x, cur=0x%04x (dropped)\n",
+		static LogRateLimit rate_limit;
+		log_rate_limited(&rate_limit, LogLevel_Warning, "Blocks going backwards: prev=0x%04x, cur=0x%04x (dropped)",
 			q->back().timecode, timecode);
-		frame.owner->release_frame(frame);
+		if (frame.owner != nullptr) {  // Skipped frames are empty.
+			frame.owner->release_frame(frame);
+		}
 		return;
 	}
 
@@ -358,6 +962,7 @@ void BMUSBCapture::dequeue_thread_func()
 	char thread_name[16];
 	snprintf(thread_name, sizeof(thread_name), "bmusb_dequeue_%d", card_index);
 	pthread_setname_np(pthread_self(), thread_name);
+	apply_thread_scheduling(dequeue_thread_scheduling, thread_name);
 
 	if (has_dequeue_callbacks) {
 		dequeue_init_callback();
@@ -365,7 +970,9 @@ void BMUSBCapture::dequeue_thread_func()
 	size_t last_sample_rate = 48000;
 	while (!dequeue_thread_should_quit) {
 		unique_lock<mutex> lock(queue_lock);
-		queues_not_empty.wait(lock, [this]{ return dequeue_thread_should_quit || (!pending_video_frames.empty() && !pending_audio_frames.empty()); });
+		// With an audio ring buffer, there are no audio frames to pair up with.
+		const bool audio_ring = (audio_ring_buffer != nullptr);
+		queues_not_empty.wait(lock, [this, audio_ring]{ return dequeue_thread_should_quit || (!pending_video_frames.empty() && (audio_ring || !pending_audio_frames.empty())); });
 
 		if (dequeue_thread_should_quit) break;
 
@@ -378,27 +985,51 @@ void BMUSBCapture::dequeue_thread_func()
 		// --- MODIFIED: FORCE VIDEO OUTPUT ---
 		// We skipped the "if (video < audio)" checks that were dropping frames.
 		QueuedFrame video_frame = pending_video_frames.front();
-		QueuedFrame audio_frame = pending_audio_frames.front();
-		pending_audio_frames.pop_front();
+		QueuedFrame audio_frame;
+		size_t audio_len, audio_offset;
 		pending_video_frames.pop_front();
+		if (audio_ring) {
+			audio_frame.format = last_audio_format;
+			audio_len = last_audio_block_len;
+			audio_offset = 0;
+		} else {
+			audio_frame = pending_audio_frames.front();
+			pending_audio_frames.pop_front();
+			audio_len = audio_frame.frame.len;
+			audio_offset = AUDIO_HEADER_SIZE;
+		}
 		lock.unlock();
 
 		VideoFormat video_format;
 		audio_format.id = audio_frame.format;
 		if (decode_video_format(video_frame.format, &video_format)) {
-			if (audio_frame.frame.len != 0) {
-				audio_format.sample_rate = guess_sample_rate(video_format, audio_frame.frame.len, last_sample_rate);
+			if (audio_len != 0) {
+				audio_format.sample_rate = guess_sample_rate(video_format, audio_len, last_sample_rate);
 				last_sample_rate = audio_format.sample_rate;
 			}
+			// Frames skipped by decimation are empty, without a header.
+			size_t video_offset = (video_frame.frame.len == 0) ? 0 : HEADER_SIZE;
+			if (video_frame.frame.len != 0) {
+				compute_frame_crop(&video_format, nullptr);
+				if (startup_ns[Startup_FirstFrame].load(memory_order_relaxed) == 0) {
+					mark_startup(Startup_FirstFrame);
+					log_startup_stats(get_startup_stats());
+					{
+						lock_guard<mutex> lock(warmup_mutex);
+						first_frame_delivered = true;
+					}
+					warmup_cv.notify_all();
+				}
+			}
 			frame_callback(video_timecode,
-				       video_frame.frame, HEADER_SIZE, video_format,
-				       audio_frame.frame, AUDIO_HEADER_SIZE, audio_format);
+				       video_frame.frame, video_offset, video_format,
+				       audio_frame.frame, audio_offset, audio_format);
 		} else {
 			video_frame_allocator->release_frame(video_frame.frame);
 			audio_format.sample_rate = last_sample_rate;
 			frame_callback(video_timecode,
 			               FrameAllocator::Frame(), 0, video_format,
-				       audio_frame.frame, AUDIO_HEADER_SIZE, audio_format);
+				       audio_frame.frame, audio_offset, audio_format);
 		}
 	}
 	if (has_dequeue_callbacks) {
@@ -406,201 +1037,1651 @@ void BMUSBCapture::dequeue_thread_func()
 	}
 }
 
+// Bytes per line of the Y' plane (or of the packed picture, for YUYV)
+// after conversion; see OutputPixelFormat.
+unsigned output_stride(OutputPixelFormat format, unsigned width)
+{
+	switch (format) {
+	case OutputPixelFormat_NV12:
+	case OutputPixelFormat_I420:
+		return width;
+	case OutputPixelFormat_YUYV:
+	case OutputPixelFormat_Planar16:
+		return width * 2;
+	default:
+		assert(false);
+		return 0;
+	}
+}
+
+bool BMUSBCapture::compute_frame_crop(VideoFormat *video_format, FrameCrop *frame_crop) const
+{
+	if (!video_format->has_signal || video_format->width <= 2) {
+		return false;
+	}
+	const bool single_field = (capture_field != 0 && video_format->interlaced);
+	const bool converting = (frame_converter != nullptr);
+	if (!video_crop_enabled && !single_field && !converting) {
+		return false;
+	}
+
+	// Horizontally, we can only split between pixel pairs that share
+	// chroma (8-bit), or between v210 blocks (10-bit).
+	const bool is_8bit = (video_format->id & 0x0800);
+	const unsigned pixels_per_group = is_8bit ? 2 : 6;
+	const unsigned bytes_per_group = is_8bit ? 4 : 16;
+	const unsigned width = video_format->width;
+	unsigned first_pixel = 0, num_pixels = width;
+	if (!zero_copy_video) {
+		first_pixel = min(crop_first_pixel, width) / pixels_per_group * pixels_per_group;
+		num_pixels = width - first_pixel;
+		if (crop_num_pixels != 0) {
+			num_pixels = min(crop_num_pixels, num_pixels);
+		}
+	}
+
+	FrameCrop crop;
+	crop.line_stride = video_format->stride;
+	if (first_pixel == 0 && num_pixels == width) {
+		crop.line_offset = 0;
+		crop.line_bytes = video_format->stride;
+	} else {
+		num_pixels = num_pixels / pixels_per_group * pixels_per_group;
+		crop.line_offset = first_pixel / pixels_per_group * bytes_per_group;
+		crop.line_bytes = num_pixels / pixels_per_group * bytes_per_group;
+	}
+
+	const unsigned height = video_format->height;
+	unsigned first_line = min(crop_first_line, height);
+	if (video_format->interlaced) {
+		first_line &= ~1u;
+	}
+	unsigned num_lines = height - first_line;
+	if (crop_num_lines != 0) {
+		num_lines = min(crop_num_lines, num_lines);
+	}
+	if (video_format->interlaced) {
+		// The card sends the two fields one after the other,
+		// so crop them separately.
+		num_lines &= ~1u;
+		const unsigned field_start[2] = { video_format->extra_lines_top, video_format->second_field_start };
+		crop.num_regions = 0;
+		for (unsigned field = 0; field < 2; ++field) {
+			if (single_field && field != capture_field - 1) {
+				continue;
+			}
+			size_t start = HEADER_SIZE + size_t(field_start[field] + first_line / 2) * crop.line_stride;
+			crop.region_start[crop.num_regions] = start;
+			crop.region_end[crop.num_regions] = start + size_t(num_lines / 2) * crop.line_stride;
+			++crop.num_regions;
+		}
+		if (single_field) {
+			num_lines /= 2;
+			video_format->interlaced = false;
+			video_format->second_field_start = 0;
+		} else {
+			video_format->second_field_start = num_lines / 2;
+		}
+	} else {
+		crop.region_start[0] = HEADER_SIZE + size_t(video_format->extra_lines_top + first_line) * crop.line_stride;
+		crop.region_end[0] = crop.region_start[0] + size_t(num_lines) * crop.line_stride;
+		crop.num_regions = 1;
+	}
+
+	video_format->width = num_pixels;
+	video_format->height = num_lines;
+	video_format->stride = converting ? output_stride(output_pixel_format, num_pixels) : crop.line_bytes;
+	video_format->extra_lines_top = 0;
+	video_format->extra_lines_bottom = 0;
+	if (frame_crop != nullptr) {
+		*frame_crop = crop;
+	}
+	return true;
+}
+
+template<class Store>
+void BMUSBCapture::FrameCrop::for_each_kept(size_t pos, const uint8_t *from, const uint8_t *to, Store store) const
+{
+	unsigned region = 0;
+	size_t lines_before_region = 0;  // In the cropped frame.
+	while (from < to) {
+		// Find how many bytes we can keep or skip in one go.
+		size_t bytes, line = 0, column = 0;
+		bool keep;
+		while (region < num_regions && pos >= region_end[region]) {
+			lines_before_region += (region_end[region] - region_start[region]) / line_stride;
+			++region;
+		}
+		if (pos < HEADER_SIZE) {
+			bytes = HEADER_SIZE - pos;
+			keep = true;
+			line = header_line;
+			column = pos;
+		} else if (region == num_regions) {
+			return;
+		} else if (pos < region_start[region]) {
+			bytes = region_start[region] - pos;
+			keep = false;
+		} else {
+			line = lines_before_region + (pos - region_start[region]) / line_stride;
+			column = (pos - region_start[region]) % line_stride;
+			if (column < line_offset) {
+				bytes = line_offset - column;
+				keep = false;
+			} else if (column < line_offset + line_bytes) {
+				bytes = line_offset + line_bytes - column;
+				keep = true;
+				column -= line_offset;
+			} else {
+				bytes = line_stride - column;
+				keep = false;
+			}
+		}
+
+		bytes = min<size_t>(bytes, to - from);
+		if (keep) {
+			store(from, from + bytes, line, column);
+		}
+		from += bytes;
+		pos += bytes;
+	}
+}
+
 void BMUSBCapture::start_new_frame(const uint8_t *start)
 {
 	uint16_t format = (start[3] << 8) | start[2];
 	uint16_t timecode = (start[1] << 8) | start[0];
 
-	if (current_video_frame.len > 0) {
+	if (startup_ns[Startup_FirstHeader].load(memory_order_relaxed) == 0) {
+		mark_startup(Startup_FirstHeader);
+	}
+	if (awaiting_frame_after_recovery) {
+		// Back in sync; see get_recovery_stats().
+		awaiting_frame_after_recovery = false;
+		int64_t recovery_time_ns = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count() - recovery_start_ns;
+		last_recovery_time_ns = recovery_time_ns;
+		if (recovery_time_ns > max_recovery_time_ns) {
+			max_recovery_time_ns = recovery_time_ns;
+		}
+		++recoveries;
+		log_message(LogLevel_Info, "Recovered from USB transfer error in %.1f ms", recovery_time_ns * 1e-6);
+	}
+
+	// Skipped frames are queued (empty) too; see set_frame_decimation().
+	if (current_video_frame.len > 0 || current_video_frame_skipped) {
 		current_video_frame.received_timestamp = steady_clock::now();
 
-		if (format == 0x0800) {
-			FrameAllocator::Frame fake_audio_frame = audio_frame_allocator->alloc_frame();
-			if (fake_audio_frame.data == nullptr) {
-				printf("Couldn't allocate fake audio frame, also dropping no-signal video frame.\n");
-				current_video_frame.owner->release_frame(current_video_frame);
-				current_video_frame = video_frame_allocator->alloc_frame();
+		bool dropped = false;
+		if (format == 0x0800 && audio_ring_buffer == nullptr) {
+			FrameAllocator::Frame fake_audio_frame = audio_frame_allocator->alloc_frame();
+			if (fake_audio_frame.data == nullptr) {
+				static LogRateLimit rate_limit;
+				log_rate_limited(&rate_limit, LogLevel_Warning, "Couldn't allocate fake audio frame, also dropping no-signal video frame.");
+				if (current_video_frame.owner != nullptr) {
+					current_video_frame.owner->release_frame(current_video_frame);
+				}
+				dropped = true;
+			} else {
+				queue_frame(format, timecode, fake_audio_frame, &pending_audio_frames);
+			}
+		}
+		if (!dropped) {
+			queue_frame(format, timecode, current_video_frame, &pending_video_frames);
+		}
+	}
+
+	// If we know the format, we also know exactly how long the frame is
+	// going to be, which means decode_packs() won't have to search for
+	// the next sync pattern once it has confirmed that the length holds.
+	VideoFormat video_format;
+	size_t expected_frame_bytes = 0;
+	current_video_frame_cropped = false;
+	if (decode_video_format(format, &video_format) && video_format.has_signal && video_format.width > 2) {
+		expected_frame_bytes = HEADER_SIZE + video_format.stride *
+			(video_format.height + video_format.extra_lines_top + video_format.extra_lines_bottom);
+		update_video_mode(video_format, expected_frame_bytes);
+		current_video_frame_cropped = compute_frame_crop(&video_format, &current_video_crop);
+	}
+	video_sync.set_expected_frame_bytes(expected_frame_bytes);
+
+	// Decimated frames don't get a frame at all, so decode_packs() will
+	// just count their bytes (which is nearly free once it is locked).
+	unsigned decimation = frame_decimation.load(memory_order_relaxed);
+	if (expected_frame_bytes > 0 && decimation > 1) {
+		decimation_phase = (decimation_phase + 1) % decimation;
+	} else {
+		decimation_phase = 0;
+	}
+	current_video_frame_skipped = (decimation_phase != 0);
+	if (current_video_frame_skipped) {
+		current_video_frame = FrameAllocator::Frame();
+		update_drop_state(&video_sync, false, "video");
+	} else {
+		current_video_frame = video_frame_allocator->alloc_frame();
+		update_drop_state(&video_sync, current_video_frame.data == nullptr && current_video_frame.spans == nullptr, "video");
+		if (current_video_frame_cropped && frame_converter != nullptr) {
+			frame_converter->start_frame(video_format);
+		}
+	}
+}
+
+void BMUSBCapture::start_new_audio_block(const uint8_t *start)
+{
+	if (audio_decoder != nullptr) {
+		uint16_t format;
+		size_t len = audio_decoder->end_block(&format);
+		if (len > 0) {
+			last_audio_block_len = len;
+			last_audio_format = format;
+		}
+		return;
+	}
+
+	uint16_t format = (start[3] << 8) | start[2];
+	uint16_t timecode = (start[1] << 8) | start[0];
+	if (current_audio_frame.len > 0) {
+		current_audio_frame.received_timestamp = steady_clock::now();
+		queue_frame(format, timecode, current_audio_frame, &pending_audio_frames);
+	}
+	current_audio_frame = audio_frame_allocator->alloc_frame();
+	update_drop_state(&audio_sync, current_audio_frame.data == nullptr, "audio");
+}
+
+void BMUSBCapture::update_video_mode(const VideoFormat &video_format, size_t expected_frame_bytes)
+{
+	// If we are waiting for a new mode to lock, the frame that just ended
+	// was in that mode, and the sync state tells whether it had exactly
+	// the expected length.
+	if (!mode_locked.load(memory_order_relaxed) && video_sync.locked) {
+		int64_t time_to_lock_ns = duration_cast<nanoseconds>(steady_clock::now() - mode_change_time).count();
+		last_time_to_lock_ns = time_to_lock_ns;
+		if (time_to_lock_ns > max_time_to_lock_ns) {
+			max_time_to_lock_ns = time_to_lock_ns;
+		}
+		mode_change_errored_packets = video_errored_packets - errored_packets_at_mode_change;
+		mode_locked = true;
+		log_message(LogLevel_Info, "New video mode locked in %.1f ms (%lu errored packets)",
+			time_to_lock_ns * 1e-6, (unsigned long)mode_change_errored_packets.load());
+	}
+
+	if (expected_frame_bytes == 0 ||
+	    (video_format.width == last_video_width && expected_frame_bytes == last_video_frame_bytes)) {
+		return;
+	}
+	last_video_width = video_format.width;
+	last_video_frame_bytes = expected_frame_bytes;
+	mode_change_time = steady_clock::now();
+	errored_packets_at_mode_change = video_errored_packets;
+	mode_changes.store(mode_changes.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	mode_locked = false;
+
+	// Every video transfer still out there is laid out for the old mode,
+	// and will likely overflow if the new one is wider, so make sure each
+	// of them gets the new layout as soon as it comes back, instead of
+	// only the ones that happen to be resubmitted from here.
+	// No-signal frames don't change anything, so that we are ready for
+	// whatever mode comes back.
+	if (video_format.width >= MIN_WIDTH) {
+		assumed_frame_width = video_format.width;
+		min_tuned_packet_size = 0;
+		tune_window_packets = 0;
+		tune_window_max_packet_bytes = 0;
+		video_packet_counters.max_packet_bytes = 0;
+		size_t size = find_xfer_size_for_width(current_pixel_format, video_format.width);
+		if (size != video_packet_size) {
+			set_video_packet_size(size);
+		}
+	}
+}
+
+void BMUSBCapture::set_video_packet_size(size_t size)
+{
+	video_packet_size = size;
+	video_xfr_layout_generation.fetch_add(1, memory_order_release);
+}
+
+void BMUSBCapture::update_drop_state(SyncState *sync, bool dropping, const char *frame_type_name)
+{
+	sync->dropping = dropping;
+	if (!dropping) {
+		return;
+	}
+	sync->dropped_frames.store(sync->dropped_frames.load(memory_order_relaxed) + 1, memory_order_relaxed);
+
+	// Note that we do not lock onto expected_frame_bytes here (even
+	// though nothing looks at the data) unless found_sync() has confirmed
+	// it; if it were wrong, a real sync at some other offset would be
+	// skipped as data, and the mode would look locked too early (see
+	// update_video_mode()). Once locked, dropping is nearly free anyway.
+
+	static LogRateLimit rate_limit;
+	log_rate_limited(&rate_limit, LogLevel_Warning, "Dropping %s frames; consumer is falling behind (%lu frames, %lu bytes dropped so far)",
+		frame_type_name, (unsigned long)sync->dropped_frames.load(memory_order_relaxed),
+		(unsigned long)sync->dropped_bytes.load(memory_order_relaxed));
+}
+
+void memcpy_interleaved_slow(uint8_t *dest1, uint8_t *dest2, const uint8_t *src, size_t n)
+{
+	assert(n % 2 == 0);
+	uint8_t *dptr1 = dest1;
+	uint8_t *dptr2 = dest2;
+
+	for (size_t i = 0; i < n; i += 2) {
+		*dptr1++ = *src++;
+		*dptr2++ = *src++;
+	}
+}
+
+// Splits <src> into even bytes (to <dest1>) and odd bytes (to <dest2>);
+// <n> must be even. add_to_frame() takes care of frames that end up
+// at an odd offset. Like copy_until_sync_char(), we pick the best
+// version for the CPU at runtime; the default version uses SSE2.
+#if HAS_MULTIVERSIONING
+
+__attribute__((target("default")))
+void memcpy_interleaved(uint8_t *dest1, uint8_t *dest2, const uint8_t *src, size_t n)
+{
+	assert(n % 2 == 0);
+#if __SSE2__
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	for ( ; n >= 32; n -= 32, src += 32, dest1 += 16, dest2 += 16) {
+		__m128i data0 = _mm_loadu_si128((const __m128i *)src);
+		__m128i data1 = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i even = _mm_packus_epi16(_mm_and_si128(data0, mask), _mm_and_si128(data1, mask));
+		__m128i odd = _mm_packus_epi16(_mm_srli_epi16(data0, 8), _mm_srli_epi16(data1, 8));
+		_mm_storeu_si128((__m128i *)dest1, even);
+		_mm_storeu_si128((__m128i *)dest2, odd);
+	}
+#endif
+	memcpy_interleaved_slow(dest1, dest2, src, n);
+}
+
+__attribute__((target("ssse3")))
+void memcpy_interleaved(uint8_t *dest1, uint8_t *dest2, const uint8_t *src, size_t n)
+{
+	assert(n % 2 == 0);
+
+	// Even bytes to the lower half, odd bytes to the upper half.
+	const __m128i shuffle = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+	for ( ; n >= 32; n -= 32, src += 32, dest1 += 16, dest2 += 16) {
+		__m128i data0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), shuffle);
+		__m128i data1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 16)), shuffle);
+		_mm_storeu_si128((__m128i *)dest1, _mm_unpacklo_epi64(data0, data1));
+		_mm_storeu_si128((__m128i *)dest2, _mm_unpackhi_epi64(data0, data1));
+	}
+	memcpy_interleaved_slow(dest1, dest2, src, n);
+}
+
+__attribute__((target("avx2")))
+void memcpy_interleaved(uint8_t *dest1, uint8_t *dest2, const uint8_t *src, size_t n)
+{
+	assert(n % 2 == 0);
+	const __m256i mask = _mm256_set1_epi16(0x00ff);
+	for ( ; n >= 64; n -= 64, src += 64, dest1 += 32, dest2 += 32) {
+		__m256i data0 = _mm256_loadu_si256((const __m256i *)src);
+		__m256i data1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+
+		// The packs work within each 128-bit lane, so the results come out
+		// as 64-bit quarters in the order 0, 2, 1, 3; put them back in order.
+		__m256i even = _mm256_packus_epi16(_mm256_and_si256(data0, mask), _mm256_and_si256(data1, mask));
+		__m256i odd = _mm256_packus_epi16(_mm256_srli_epi16(data0, 8), _mm256_srli_epi16(data1, 8));
+		_mm256_storeu_si256((__m256i *)dest1, _mm256_permute4x64_epi64(even, 0xd8));
+		_mm256_storeu_si256((__m256i *)dest2, _mm256_permute4x64_epi64(odd, 0xd8));
+	}
+	memcpy_interleaved_slow(dest1, dest2, src, n);
+}
+
+#else
+
+void memcpy_interleaved(uint8_t *dest1, uint8_t *dest2, const uint8_t *src, size_t n)
+{
+	memcpy_interleaved_slow(dest1, dest2, src, n);
+}
+
+#endif
+
+void add_to_frame(FrameAllocator::Frame *current_frame, const char *frame_type_name, const uint8_t *start, const uint8_t *end)
+{
+	if (current_frame->data == nullptr ||
+	    current_frame->len > current_frame->size ||
+	    start == end) {
+		return;
+	}
+
+	int bytes = end - start;
+	if (current_frame->len + bytes > current_frame->size) {
+		// Keep counting (for the frame's owner), but only complain once.
+		const size_t old_overflow = current_frame->overflow;
+		current_frame->overflow += current_frame->len + bytes - current_frame->size;
+		current_frame->len = current_frame->size;
+		if (old_overflow <= 1048576 && current_frame->overflow > 1048576) {
+			static LogRateLimit rate_limit;
+			log_rate_limited(&rate_limit, LogLevel_Warning, "%d bytes overflow after last %s frame",
+				int(current_frame->overflow), frame_type_name);
+		}
+	} else {
+		if (current_frame->data_copy != nullptr) {
+			memcpy(current_frame->data_copy + current_frame->len, start, bytes);
+		}
+		if (current_frame->interleaved) {
+			uint8_t *data = current_frame->data + current_frame->len / 2;
+			uint8_t *data2 = current_frame->data2 + current_frame->len / 2;
+			if (current_frame->len % 2 == 1) {
+				++data;
+				swap(data, data2);
+			}
+			if (bytes % 2 == 1) {
+				*data++ = *start++;
+				swap(data, data2);
+				++current_frame->len;
+				--bytes;
+			}
+			memcpy_interleaved(data, data2, start, bytes);
+			current_frame->len += bytes;
+		} else {
+			memcpy(current_frame->data + current_frame->len, start, bytes);
+			current_frame->len += bytes;
+		}
+	}
+}
+
+void BMUSBCapture::FrameConverter::start_frame(const VideoFormat &video_format)
+{
+	ten_bit = !(video_format.id & 0x0800);
+	group_bytes = ten_bit ? 16 : 4;
+	group_pixels = ten_bit ? 6 : 2;
+	width = video_format.width;
+	height = video_format.height;
+
+	const size_t luma_bytes = size_t(output_stride(format, width)) * height;
+	switch (format) {
+	case OutputPixelFormat_NV12:
+		chroma_offset[0] = chroma_offset[1] = luma_bytes;
+		picture_bytes = luma_bytes + width * ((height + 1) / 2);
+		break;
+	case OutputPixelFormat_I420:
+		chroma_offset[0] = luma_bytes;
+		chroma_offset[1] = luma_bytes + width / 2 * ((height + 1) / 2);
+		picture_bytes = chroma_offset[1] + width / 2 * ((height + 1) / 2);
+		break;
+	case OutputPixelFormat_Planar16:
+		chroma_offset[0] = luma_bytes;
+		chroma_offset[1] = luma_bytes + width * height;
+		picture_bytes = chroma_offset[1] + width * height;
+		break;
+	default:
+		chroma_offset[0] = chroma_offset[1] = 0;
+		picture_bytes = luma_bytes;
+		break;
+	}
+	carry_len = 0;
+}
+
+void BMUSBCapture::FrameConverter::add(FrameAllocator::Frame *frame, const uint8_t *start, const uint8_t *end, size_t line, size_t column)
+{
+	if (HEADER_SIZE + picture_bytes > frame->size) {
+		frame->overflow += end - start;
+		return;
+	}
+	if (line == FrameCrop::header_line) {
+		memcpy(frame->data + column, start, end - start);
+		frame->len += end - start;
+		return;
+	}
+	uint8_t *picture = frame->data + HEADER_SIZE;
+
+	// Finish any pixel group that was split across packets. Lines always
+	// end on a group boundary, so the rest of it is what we got now.
+	if (carry_len > 0) {
+		size_t bytes = min<size_t>(end - start, group_bytes - carry_len);
+		memcpy(carry + carry_len, start, bytes);
+		carry_len += bytes;
+		start += bytes;
+		column += bytes;
+		if (carry_len < group_bytes) {
+			return;
+		}
+		frame->len += convert(picture, carry, group_bytes, carry_line, carry_column);
+		carry_len = 0;
+	}
+
+	size_t bytes = (end - start) / group_bytes * group_bytes;
+	frame->len += convert(picture, start, bytes, line, column);
+	start += bytes;
+	column += bytes;
+
+	carry_len = end - start;
+	carry_line = line;
+	carry_column = column;
+	memcpy(carry, start, carry_len);
+}
+
+size_t BMUSBCapture::FrameConverter::convert(uint8_t *picture, const uint8_t *src, size_t bytes, size_t line, size_t column)
+{
+	size_t x = column / group_bytes * group_pixels;
+	if (!ten_bit && format != OutputPixelFormat_Planar16) {
+		return convert_uyvy(picture, src, bytes, line, x);
+	}
+
+	size_t written = 0;
+	if (!ten_bit) {
+		for (size_t i = 0; i < bytes; i += 4, x += 2) {
+			written += put_pair(picture, line, x, src[i + 1] << 2, src[i + 3] << 2, src[i] << 2, src[i + 2] << 2);
+		}
+		return written;
+	}
+	for (size_t i = 0; i < bytes; i += 16, x += 6) {
+		// See PixelFormat_10BitYCbCr for the layout.
+		uint32_t w[4];
+		for (unsigned j = 0; j < 4; ++j) {
+			const uint8_t *p = src + i + j * 4;
+			w[j] = p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+		}
+		const unsigned y[6] = {
+			(w[0] >> 10) & 0x3ff, w[1] & 0x3ff, (w[1] >> 20) & 0x3ff,
+			(w[2] >> 10) & 0x3ff, w[3] & 0x3ff, (w[3] >> 20) & 0x3ff
+		};
+		const unsigned cb[3] = { w[0] & 0x3ff, (w[1] >> 10) & 0x3ff, (w[2] >> 20) & 0x3ff };
+		const unsigned cr[3] = { (w[0] >> 20) & 0x3ff, w[2] & 0x3ff, (w[3] >> 10) & 0x3ff };
+
+		// The last group of a line can have padding pixels after the picture.
+		for (unsigned j = 0; j < 3 && x + j * 2 < width; ++j) {
+			written += put_pair(picture, line, x + j * 2, y[j * 2], y[j * 2 + 1], cb[j], cr[j]);
+		}
+	}
+	return written;
+}
+
+// The common cases (8-bit input to 8-bit output) are mostly a matter
+// of splitting bytes apart, so they go through memcpy_interleaved()
+// instead of pixel by pixel.
+size_t BMUSBCapture::FrameConverter::convert_uyvy(uint8_t *picture, const uint8_t *src, size_t bytes, size_t line, size_t x)
+{
+	if (format == OutputPixelFormat_YUYV) {
+		uint8_t *dst = picture + (line * width + x) * 2;
+		size_t i = 0;
+#if __SSE2__
+		for ( ; i + 16 <= bytes; i += 16) {
+			__m128i val = _mm_loadu_si128((const __m128i *)(src + i));
+			val = _mm_or_si128(_mm_slli_epi16(val, 8), _mm_srli_epi16(val, 8));
+			_mm_storeu_si128((__m128i *)(dst + i), val);
+		}
+#endif
+		for ( ; i < bytes; i += 2) {
+			dst[i] = src[i + 1];
+			dst[i + 1] = src[i];
+		}
+		return bytes;
+	}
+
+	// 4:2:0 only keeps the chroma of every other line.
+	uint8_t *luma = picture + line * width + x;
+	const bool has_chroma = (line % 2 == 0);
+	if (format == OutputPixelFormat_NV12 && has_chroma) {
+		// Cb and Cr are already interleaved the way NV12 wants them.
+		memcpy_interleaved(picture + chroma_offset[0] + line / 2 * width + x, luma, src, bytes);
+		return bytes;
+	}
+
+	uint8_t chroma[256];
+	uint8_t *cb = picture + chroma_offset[0] + line / 2 * (width / 2) + x / 2;
+	uint8_t *cr = picture + chroma_offset[1] + line / 2 * (width / 2) + x / 2;
+	for (size_t i = 0; i < bytes; i += sizeof(chroma) * 2) {
+		size_t n = min(bytes - i, sizeof(chroma) * 2);
+		memcpy_interleaved(chroma, luma + i / 2, src + i, n);
+		if (has_chroma) {
+			memcpy_interleaved(cb + i / 4, cr + i / 4, chroma, n / 2);
+		}
+	}
+	return has_chroma ? bytes : bytes / 2;
+}
+
+size_t BMUSBCapture::FrameConverter::put_pair(uint8_t *picture, size_t line, size_t x, unsigned y0, unsigned y1, unsigned cb, unsigned cr)
+{
+	const bool has_chroma = (line % 2 == 0);
+	switch (format) {
+	case OutputPixelFormat_YUYV: {
+		uint8_t *dst = picture + (line * width + x) * 2;
+		dst[0] = y0 >> 2;
+		dst[1] = cb >> 2;
+		dst[2] = y1 >> 2;
+		dst[3] = cr >> 2;
+		return 4;
+	}
+	case OutputPixelFormat_NV12:
+		picture[line * width + x] = y0 >> 2;
+		picture[line * width + x + 1] = y1 >> 2;
+		if (!has_chroma) {
+			return 2;
+		}
+		picture[chroma_offset[0] + line / 2 * width + x] = cb >> 2;
+		picture[chroma_offset[0] + line / 2 * width + x + 1] = cr >> 2;
+		return 4;
+	case OutputPixelFormat_I420:
+		picture[line * width + x] = y0 >> 2;
+		picture[line * width + x + 1] = y1 >> 2;
+		if (!has_chroma) {
+			return 2;
+		}
+		picture[chroma_offset[0] + line / 2 * (width / 2) + x / 2] = cb >> 2;
+		picture[chroma_offset[1] + line / 2 * (width / 2) + x / 2] = cr >> 2;
+		return 4;
+	case OutputPixelFormat_Planar16: {
+		const uint16_t values[4] = { uint16_t(y0), uint16_t(y1), uint16_t(cb), uint16_t(cr) };
+		uint8_t *dst[4] = {
+			picture + (line * width + x) * 2,
+			picture + (line * width + x + 1) * 2,
+			picture + chroma_offset[0] + (line * (width / 2) + x / 2) * 2,
+			picture + chroma_offset[1] + (line * (width / 2) + x / 2) * 2
+		};
+		for (unsigned i = 0; i < 4; ++i) {
+			dst[i][0] = values[i] & 0xff;
+			dst[i][1] = values[i] >> 8;
+		}
+		return 8;
+	}
+	default:
+		return 0;
+	}
+}
+
+// Copies bytes from <src> to <dest> until the first occurrence of <sync_char>
+// (or <n> bytes, whichever comes first), and returns the number of bytes copied.
+// If <dest> is nullptr, only scans. This is the inner loop for everything
+// coming in from the card, so we scan and copy in the same pass instead of
+// going through the data once with memmem() and once more with memcpy().
+//
+// We use function multiversioning to pick the AVX2 version at runtime
+// if the CPU supports it; the default version uses SSE2, which is always
+// available on x86-64, so older machines are still fine.
+size_t copy_until_sync_char_tail(uint8_t *dest, const uint8_t *src, size_t n, uint8_t sync_char)
+{
+	const uint8_t *hit = (const uint8_t *)memchr(src, sync_char, n);
+	size_t bytes = (hit == nullptr) ? n : hit - src;
+	if (dest != nullptr) {
+		memcpy(dest, src, bytes);
+	}
+	return bytes;
+}
+
+#if HAS_MULTIVERSIONING
+
+__attribute__((target("default")))
+size_t copy_until_sync_char(uint8_t *dest, const uint8_t *src, size_t n, uint8_t sync_char)
+{
+	size_t i = 0;
+#if __SSE2__
+	const __m128i needle = _mm_set1_epi8(sync_char);
+	for ( ; i + 16 <= n; i += 16) {
+		__m128i data = _mm_loadu_si128((const __m128i *)(src + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(data, needle));
+		if (mask != 0) {
+			size_t bytes = __builtin_ctz(mask);
+			if (dest != nullptr) {
+				memcpy(dest + i, src + i, bytes);
+			}
+			return i + bytes;
+		}
+		if (dest != nullptr) {
+			_mm_storeu_si128((__m128i *)(dest + i), data);
+		}
+	}
+#endif
+	return i + copy_until_sync_char_tail(dest ? dest + i : nullptr, src + i, n - i, sync_char);
+}
+
+__attribute__((target("avx2")))
+size_t copy_until_sync_char(uint8_t *dest, const uint8_t *src, size_t n, uint8_t sync_char)
+{
+	const __m256i needle = _mm256_set1_epi8(sync_char);
+	size_t i = 0;
+	for ( ; i + 64 <= n; i += 64) {
+		__m256i data0 = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i data1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+		__m256i eq0 = _mm256_cmpeq_epi8(data0, needle);
+		__m256i eq1 = _mm256_cmpeq_epi8(data1, needle);
+		if (!_mm256_testz_si256(_mm256_or_si256(eq0, eq1), _mm256_or_si256(eq0, eq1))) {
+			uint64_t mask = uint32_t(_mm256_movemask_epi8(eq0)) |
+				(uint64_t(uint32_t(_mm256_movemask_epi8(eq1))) << 32);
+			size_t bytes = __builtin_ctzll(mask);
+			if (dest != nullptr) {
+				memcpy(dest + i, src + i, bytes);
+			}
+			return i + bytes;
+		}
+		if (dest != nullptr) {
+			_mm256_storeu_si256((__m256i *)(dest + i), data0);
+			_mm256_storeu_si256((__m256i *)(dest + i + 32), data1);
+		}
+	}
+	return i + copy_until_sync_char_tail(dest ? dest + i : nullptr, src + i, n - i, sync_char);
+}
+
+#else
+
+size_t copy_until_sync_char(uint8_t *dest, const uint8_t *src, size_t n, uint8_t sync_char)
+{
+	return copy_until_sync_char_tail(dest, src, n, sync_char);
+}
+
+#endif
+
+// Like memcpy(), but for large copies, uses non-temporal stores for the
+// bulk of the data, so that it doesn't pull the destination into the cache.
+// Video frames are written once here and then read by a different thread
+// much later, so caching them only evicts everybody else's working set.
+// The stores are weakly ordered, so call streaming_store_fence() before
+// handing the data over to another thread.
+//
+// Like above, we pick the AVX2 version at runtime if available.
+#if HAS_MULTIVERSIONING
+
+__attribute__((target("default")))
+void memcpy_streaming(uint8_t *dest, const uint8_t *src, size_t n)
+{
+	// Below this, it's not worth the trouble (and the partial cache lines
+	// at either end would be written with regular stores anyway).
+	if (n < 256) {
+		memcpy(dest, src, n);
+		return;
+	}
+#if __SSE2__
+	// Regular stores up to the first cache line boundary.
+	size_t head = -uintptr_t(dest) & 63;
+	memcpy(dest, src, head);
+	dest += head;
+	src += head;
+	n -= head;
+
+	for ( ; n >= 64; n -= 64, dest += 64, src += 64) {
+		__m128i data0 = _mm_loadu_si128((const __m128i *)src);
+		__m128i data1 = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i data2 = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i data3 = _mm_loadu_si128((const __m128i *)(src + 48));
+		_mm_stream_si128((__m128i *)dest, data0);
+		_mm_stream_si128((__m128i *)(dest + 16), data1);
+		_mm_stream_si128((__m128i *)(dest + 32), data2);
+		_mm_stream_si128((__m128i *)(dest + 48), data3);
+	}
+#endif
+	memcpy(dest, src, n);
+}
+
+__attribute__((target("avx2")))
+void memcpy_streaming(uint8_t *dest, const uint8_t *src, size_t n)
+{
+	if (n < 256) {
+		memcpy(dest, src, n);
+		return;
+	}
+	size_t head = -uintptr_t(dest) & 63;
+	memcpy(dest, src, head);
+	dest += head;
+	src += head;
+	n -= head;
+
+	for ( ; n >= 64; n -= 64, dest += 64, src += 64) {
+		__m256i data0 = _mm256_loadu_si256((const __m256i *)src);
+		__m256i data1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+		_mm256_stream_si256((__m256i *)dest, data0);
+		_mm256_stream_si256((__m256i *)(dest + 32), data1);
+	}
+	memcpy(dest, src, n);
+}
+
+#else
+
+void memcpy_streaming(uint8_t *dest, const uint8_t *src, size_t n)
+{
+	memcpy(dest, src, n);
+}
+
+#endif
+
+// The same for both versions of memcpy_streaming() above. (Every CPU
+// with USB3 has SSE, even if we are not compiled for it.)
+#if HAS_MULTIVERSIONING
+__attribute__((target("sse")))
+void streaming_store_fence()
+{
+	_mm_sfence();
+}
+#else
+void streaming_store_fence()
+{
+}
+#endif
+
+// How bytes for a given frame need to be stored. This only changes when
+// a new frame is started, so decode_packs() figures it out once per frame
+// instead of checking all the flags for every span it adds.
+enum class FrameCopyMode {
+	DISCARD,    // No frame to put the data in.
+	ZERO_COPY,  // The frame only gets a reference to the USB buffer.
+	PLAIN,      // A single contiguous copy; can be fused with the sync scan.
+	GENERAL,    // Interleaving and/or data_copy; left to add_to_frame().
+	CONVERT,    // Converted to another pixel format; see FrameConverter.
+	AUDIO_RING, // Decoded straight into an AudioRingBuffer.
+};
+
+FrameCopyMode get_frame_copy_mode(const FrameAllocator::Frame *frame, bool zero_copy, bool audio_ring, bool convert)
+{
+	if (audio_ring) {
+		return FrameCopyMode::AUDIO_RING;
+	} else if (frame->data == nullptr && frame->spans == nullptr) {
+		return FrameCopyMode::DISCARD;
+	} else if (zero_copy) {
+		return FrameCopyMode::ZERO_COPY;
+	} else if (convert) {
+		return FrameCopyMode::CONVERT;
+	} else if (!frame->interleaved && frame->data_copy == nullptr) {
+		return FrameCopyMode::PLAIN;
+	} else {
+		return FrameCopyMode::GENERAL;
+	}
+}
+
+// Length of the longest prefix of <pattern> that is also a suffix of
+// pattern[0..matched) followed by <next>; ie., how much of a sync pattern
+// we have matched after seeing one more byte.
+size_t extend_sync_match(const char *pattern, size_t matched, uint8_t next)
+{
+	for (size_t len = matched + 1; len > 0; --len) {
+		if (uint8_t(pattern[len - 1]) == next &&
+		    memcmp(pattern, pattern + matched + 1 - len, len - 1) == 0) {
+			return len;
+		}
+	}
+	return 0;
+}
+
+// Everything decode_packs() needs to know about an endpoint, as constants
+// and inline functions so that each instantiation becomes its own
+// specialized loop (in particular, the pattern compares get inlined).
+struct BMUSBCapture::AudioEndpoint {
+	static constexpr char sync_pattern[] = "DeckLinkAudioResyncT";
+	static constexpr int sync_length = sizeof(sync_pattern) - 1;
+	static constexpr int scan_index = 0;  // No byte is rarer than another in PCM.
+	static constexpr bool streaming_stores = false;  // Small, and consumed soon.
+	static const char *frame_type_name() { return "audio"; }
+	static SyncState *sync(BMUSBCapture *usb) { return &usb->audio_sync; }
+	static FrameAllocator::Frame *current_frame(BMUSBCapture *usb) { return &usb->current_audio_frame; }
+	static ZeroCopyFrameAllocator *zero_copy(BMUSBCapture *usb) { return nullptr; }
+	static AudioBlockDecoder *audio_decoder(BMUSBCapture *usb) { return usb->audio_decoder.get(); }
+	static const FrameCrop *crop(BMUSBCapture *usb) { return nullptr; }
+	static FrameConverter *converter(BMUSBCapture *usb) { return nullptr; }
+	static PacketCounters *packet_counters(BMUSBCapture *usb) { return &usb->audio_packet_counters; }
+	static void start_callback(BMUSBCapture *usb, const uint8_t *start) { usb->start_new_audio_block(start); }
+};
+constexpr char BMUSBCapture::AudioEndpoint::sync_pattern[];
+
+struct BMUSBCapture::VideoEndpoint {
+	static constexpr char sync_pattern[] = "\x00\x00\xff\xff";
+	static constexpr int sync_length = sizeof(sync_pattern) - 1;
+	static constexpr int scan_index = 2;  // 0x00 is in nearly every v210 word; 0xff is rare.
+	static constexpr bool streaming_stores = true;  // See memcpy_streaming().
+	static const char *frame_type_name() { return "video"; }
+	static SyncState *sync(BMUSBCapture *usb) { return &usb->video_sync; }
+	static FrameAllocator::Frame *current_frame(BMUSBCapture *usb) { return &usb->current_video_frame; }
+	static ZeroCopyFrameAllocator *zero_copy(BMUSBCapture *usb) { return usb->zero_copy_allocator; }
+	static AudioBlockDecoder *audio_decoder(BMUSBCapture *usb) { return nullptr; }
+	static const FrameCrop *crop(BMUSBCapture *usb)
+	{
+		return usb->current_video_frame_cropped ? &usb->current_video_crop : nullptr;
+	}
+	static FrameConverter *converter(BMUSBCapture *usb)
+	{
+		return usb->current_video_frame_cropped ? usb->frame_converter.get() : nullptr;
+	}
+	static PacketCounters *packet_counters(BMUSBCapture *usb) { return &usb->video_packet_counters; }
+	static void start_callback(BMUSBCapture *usb, const uint8_t *start) { usb->start_new_frame(start); }
+};
+constexpr char BMUSBCapture::VideoEndpoint::sync_pattern[];
+
+template<class Endpoint>
+void BMUSBCapture::decode_packs(TransferState *xfr_state, PacketCounts *counts)
+{
+	const libusb_transfer *xfr = xfr_state->xfr;
+	const char *sync_pattern = Endpoint::sync_pattern;
+	constexpr int sync_length = Endpoint::sync_length;
+	constexpr int scan_index = Endpoint::scan_index;
+	SyncState *sync = Endpoint::sync(this);
+	FrameAllocator::Frame *current_frame = Endpoint::current_frame(this);
+	ZeroCopyFrameAllocator *zero_copy = Endpoint::zero_copy(this);
+	AudioBlockDecoder *audio_decoder = Endpoint::audio_decoder(this);
+
+	FrameConverter *converter = Endpoint::converter(this);
+	FrameCopyMode mode = get_frame_copy_mode(current_frame, zero_copy != nullptr, audio_decoder != nullptr, converter != nullptr);
+	const FrameCrop *crop = Endpoint::crop(this);
+	auto start_callback = [&](const uint8_t *start) {
+		if (Endpoint::streaming_stores) {
+			// The frame is about to be handed over to the dequeue thread.
+			streaming_store_fence();
+		}
+		Endpoint::start_callback(this, start);
+		current_frame->metadata = FrameMetadata();
+		current_frame->metadata.first_packet_timestamp = xfr_state->completed_at;
+		current_frame->metadata.first_transfer_sequence = xfr_state->sequence;
+		current_frame->metadata.last_transfer_sequence = xfr_state->sequence;
+		converter = Endpoint::converter(this);
+		mode = get_frame_copy_mode(current_frame, zero_copy != nullptr, audio_decoder != nullptr, converter != nullptr);
+		crop = Endpoint::crop(this);
+		current_frame->metadata.converted = (mode == FrameCopyMode::CONVERT);
+	};
+
+	// Zero-copy frames just get a reference to the data (held by <owner>);
+	// everything else gets copied.
+	auto store = [&](TransferState *owner, const uint8_t *from, const uint8_t *to) {
+		switch (mode) {
+		case FrameCopyMode::DISCARD:
+			if (sync->dropping) {
+				sync->count_dropped_bytes(to - from);
+			}
+			break;
+		case FrameCopyMode::ZERO_COPY:
+			zero_copy->add_to_frame(current_frame, owner, from, to);
+			break;
+		case FrameCopyMode::PLAIN:
+			if (current_frame->len + (to - from) <= current_frame->size) {
+				if (Endpoint::streaming_stores) {
+					memcpy_streaming(current_frame->data + current_frame->len, from, to - from);
+				} else {
+					memcpy(current_frame->data + current_frame->len, from, to - from);
+				}
+				current_frame->len += to - from;
+				break;
+			}
+			// Overflow; let add_to_frame() deal with it.
+			add_to_frame(current_frame, Endpoint::frame_type_name(), from, to);
+			break;
+		case FrameCopyMode::GENERAL:
+			add_to_frame(current_frame, Endpoint::frame_type_name(), from, to);
+			break;
+		case FrameCopyMode::AUDIO_RING:
+			audio_decoder->add(from, to);
+			break;
+		case FrameCopyMode::CONVERT:
+			assert(false);  // add_from() gives these to the converter.
+			break;
+		}
+	};
+	auto add_from = [&](TransferState *owner, const uint8_t *from, const uint8_t *to) {
+		if (mode == FrameCopyMode::CONVERT) {
+			// The converter needs to know where in the picture each byte goes.
+			crop->for_each_kept(sync->bytes_since_sync, from, to, [&](const uint8_t *keep_from, const uint8_t *keep_to, size_t line, size_t column) {
+				converter->add(current_frame, keep_from, keep_to, line, column);
+			});
+		} else if (crop != nullptr && mode != FrameCopyMode::DISCARD) {
+			crop->for_each_kept(sync->bytes_since_sync, from, to, [&](const uint8_t *keep_from, const uint8_t *keep_to, size_t, size_t) {
+				store(owner, keep_from, keep_to);
+			});
+		} else {
+			store(owner, from, to);
+		}
+		sync->bytes_since_sync += to - from;
+	};
+	auto add = [&](const uint8_t *from, const uint8_t *to) {
+		add_from(xfr_state, from, to);
+	};
+
+	// Adds the first <bytes> bytes of a partial sync pattern that we held
+	// back from an earlier packet, once we know they are not part of an
+	// actual sync pattern after all. Since they matched the pattern, we
+	// can take them from the pattern itself instead of from a USB buffer
+	// that may already have been given back to the card.
+	auto add_held_back = [&](size_t bytes) {
+		const uint8_t *from = reinterpret_cast<const uint8_t *>(sync_pattern);
+		add_from(nullptr, from, from + bytes);
+	};
+
+	current_frame->metadata.last_transfer_sequence = xfr_state->sequence;
+
+	int offset = 0;
+	for (int i = 0; i < xfr->num_iso_packets; i++) {
+		const libusb_iso_packet_descriptor *pack = &xfr->iso_packet_desc[i];
+
+		++counts->packets;
+		counts->requested_bytes += pack->length;
+		if (pack->status != LIBUSB_TRANSFER_COMPLETED) {
+			++counts->errored_packets;
+			if (pack->status == LIBUSB_TRANSFER_OVERFLOW) {
+				++counts->overflowed_packets;
+			}
+
+			// Status 6 is overflow (the card sent more than we asked for);
+			// the actual length is then how much it tried to send.
+			static LogRateLimit rate_limit;
+			log_rate_limited(&rate_limit, LogLevel_Error, "Pack %u/%u on endpoint 0x%02x: status %d, requested %u bytes, got %u",
+				i, xfr->num_iso_packets, xfr->endpoint, pack->status, pack->length, pack->actual_length);
+
+			// We've lost data, so we can no longer trust our byte count,
+			// nor that a partial sync pattern continues where we left off.
+			++current_frame->metadata.errored_packets;
+			add_held_back(sync->partial_sync_bytes);
+			sync->partial_sync_bytes = 0;
+			sync->locked = false;
+			offset += pack->length;
+			continue;
+		}
+		counts->bytes += pack->actual_length;
+		counts->full_packets += (pack->actual_length == pack->length);
+		counts->max_packet_bytes = max<size_t>(counts->max_packet_bytes, pack->actual_length);
+
+		const uint8_t *start = xfr->buffer + offset;
+		const uint8_t *limit = start + pack->actual_length;
+
+		// If the previous packet ended in what could be the start of a sync
+		// pattern, see if this one completes it. Note that the pattern could
+		// also start in the middle of the held-back bytes (and it could still
+		// not be complete if this packet is very short).
+		if (sync->partial_sync_bytes > 0 && start < limit) {
+			size_t held_back = sync->partial_sync_bytes;
+			size_t matched = held_back, consumed = 0;
+			while (matched > consumed && matched < sync_length && start + consumed < limit) {
+				matched = extend_sync_match(sync_pattern, matched, start[consumed++]);
+			}
+			sync->partial_sync_bytes = 0;
+			if (matched <= consumed) {
+				// Whatever we matched (if anything) is entirely within this
+				// packet, so the normal search below will find it.
+				add_held_back(held_back);
+				sync->locked = false;
+			} else if (matched == sync_length) {
+				add_held_back(held_back + consumed - matched);
+				start += consumed;
+				sync->found_sync();
+				start_callback(start);
+			} else {
+				// Ran out of packet, and we still have a partial match.
+				add_held_back(held_back + consumed - matched);
+				sync->partial_sync_bytes = matched;
+				start = limit;
+			}
+		}
+
+		while (start < limit) {
+			if (sync->locked) {
+				// We know exactly where the next sync pattern should be,
+				// so just copy up to it and check that it's actually there.
+				assert(sync->bytes_since_sync <= sync->expected_frame_bytes);
+				size_t bytes_to_sync = sync->expected_frame_bytes - sync->bytes_since_sync;
+				if (bytes_to_sync >= size_t(limit - start)) {
+					add(start, limit);
+					break;
+				}
+				add(start, start + bytes_to_sync);
+				start += bytes_to_sync;
+				if (limit - start >= sync_length) {
+					if (memcmp(start, sync_pattern, sync_length) == 0) {
+						start += sync_length;
+						sync->found_sync();
+						start_callback(start);
+					} else {
+						// Not where we expected it; go back to searching.
+						sync->locked = false;
+					}
+				} else if (memcmp(start, sync_pattern, limit - start) == 0) {
+					sync->partial_sync_bytes = limit - start;
+					break;
+				} else {
+					sync->locked = false;
+				}
+				continue;
+			}
+
+			// Add everything up to the next possible start of a sync pattern,
+			// ie., <scan_index> bytes before the next occurrence of the pattern's
+			// byte at that index, which is picked to be rare in the payload.
+			// (Near the end of the packet, every byte is a possible start.)
+			// In the simple case, the copy is done in the same pass as the scan.
+			if (limit - start > scan_index) {
+				const size_t bytes_left = limit - start;
+				if (mode == FrameCopyMode::PLAIN && crop == nullptr &&
+				    current_frame->len + bytes_left <= current_frame->size) {
+					// This also copies the <scan_index> bytes from the possible
+					// start on, but they only count as added once we know that
+					// they are not a sync pattern after all.
+					uint8_t *dest = current_frame->data + current_frame->len;
+					memcpy(dest, start, scan_index);
+					size_t bytes = copy_until_sync_char(dest + scan_index, start + scan_index,
+						bytes_left - scan_index, sync_pattern[scan_index]);
+					current_frame->len += bytes;
+					sync->bytes_since_sync += bytes;
+					start += bytes;
+				} else {
+					const uint8_t *sync_start = start + copy_until_sync_char(nullptr, start + scan_index,
+						bytes_left - scan_index, sync_pattern[scan_index]);
+					add(start, sync_start);
+					start = sync_start;
+				}
+			}
+			if (start == limit) break;
+			assert(start < limit);
+
+			// The fast path stops at every possible start of a sync pattern,
+			// so check for the full pattern right here. If the packet ends
+			// before the pattern would, hold back the bytes until we know
+			// whether the next packet completes it.
+			if (limit - start >= sync_length) {
+				if (memcmp(start, sync_pattern, sync_length) == 0) {
+					start += sync_length;
+					sync->found_sync();
+					start_callback(start);
+					continue;
+				}
+			} else if (memcmp(start, sync_pattern, limit - start) == 0) {
+				sync->partial_sync_bytes = limit - start;
+				break;
+			}
+			add(start, start + 1);
+			++start;
+		}
+		offset += pack->length;
+	}
+	Endpoint::packet_counters(this)->add(*counts);
+}
+
+void BMUSBCapture::cb_xfr(struct libusb_transfer *xfr)
+{
+	assert(xfr->user_data != nullptr);
+	BMUSBCapture *usb;
+	TransferState *xfr_state = nullptr;
+	if (xfr->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		xfr_state = static_cast<TransferState *>(xfr->user_data);
+		usb = xfr_state->card;
+		--usb->xfrs_in_flight;
+	} else {
+		usb = static_cast<BMUSBCapture *>(xfr->user_data);
+	}
+
+	if (xfr->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		if (!usb->disconnected) {
+			log_message(LogLevel_Warning, "Device went away, stopping transfers.");
+			usb->disconnected = true;
+			if (usb->card_disconnected_callback) {
+				usb->card_disconnected_callback();
+			}
+		}
+		return;
+	}
+
+	if (xfr->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		usb->register_read_done(xfr);
+		return;
+	}
+
+	if (xfr->status != LIBUSB_TRANSFER_COMPLETED || usb->recovering) {
+		// Either something went wrong with this transfer, or it was
+		// cancelled (or just came back) while recovering from something
+		// else. There is nothing to trust in it; submit_transfer() will
+		// set it aside until the recovery is done.
+		if (xfr->status != LIBUSB_TRANSFER_COMPLETED &&
+		    !(xfr->status == LIBUSB_TRANSFER_CANCELLED && usb->recovering)) {
+			usb->request_recovery(xfr->status);
+		}
+		usb->submit_transfer(xfr_state);
+		return;
+	}
+
+	xfr_state->completed_at = steady_clock::now();
+	xfr_state->sequence = (xfr->endpoint == 0x84) ? usb->audio_xfr_sequence++ : usb->video_xfr_sequence++;
+	usb->maybe_start_register_read(xfr_state->completed_at);
+	if (usb->use_decode_thread) {
+		// Leave all the work to the decode thread, so that we can
+		// get back to handling USB events as soon as possible.
+		usb->completed_xfrs.push(xfr_state);
+		sem_post(&usb->completed_xfrs_sem);
+	} else {
+		usb->decode_transfer(xfr_state);
+	}
+}
+
+void BMUSBCapture::maybe_start_register_read(steady_clock::time_point now)
+{
+	if (register_xfr == nullptr || register_read_in_flight || recovering.load(memory_order_relaxed)) {
+		return;
+	}
+	if (!register_read_requested.load(memory_order_relaxed)) {
+		if (register_poll_interval_ms.load(memory_order_relaxed) <= 0 || now < next_register_read) {
+			return;
+		}
+	}
+	register_read_requested = false;
+	current_register = 0;
+	register_read_in_flight = true;
+	submit_register_read();
+}
+
+void BMUSBCapture::submit_register_read()
+{
+	libusb_fill_control_setup(register_xfr->buffer,
+	    LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 214, 0,
+		current_register, 4);
+	if (libusb_submit_transfer(register_xfr) < 0) {
+		// Not worth stopping the capture over (or printing from the
+		// USB thread); just give up on this pass and try again later.
+		register_read_in_flight = false;
+		next_register_read = steady_clock::now() + milliseconds(register_poll_interval_ms.load(memory_order_relaxed));
+	}
+}
+
+void BMUSBCapture::register_read_done(libusb_transfer *xfr)
+{
+	if (xfr->status != LIBUSB_TRANSFER_COMPLETED || xfr->actual_length < 4) {
+		// Typically cancelled by recover_from_error(); try again later.
+		register_read_in_flight = false;
+		next_register_read = steady_clock::now() + milliseconds(register_poll_interval_ms.load(memory_order_relaxed));
+		return;
+	}
+	memcpy(register_file + current_register, libusb_control_transfer_get_data(xfr), 4);
+	current_register += 4;
+	if (current_register < NUM_BMUSB_REGISTERS) {
+		submit_register_read();
+		return;
+	}
+
+	// A full pass; publish it. We are the only writer.
+	steady_clock::time_point now = steady_clock::now();
+	uint32_t seq = register_snapshot_seq.load(memory_order_relaxed);
+	register_snapshot_seq.store(seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	for (int i = 0; i < NUM_BMUSB_REGISTERS / 4; ++i) {
+		uint32_t word;
+		memcpy(&word, register_file + i * 4, sizeof(word));
+		register_snapshot_words[i].store(word, memory_order_relaxed);
+	}
+	register_snapshot_passes.store(register_snapshot_passes.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	register_snapshot_time_ns.store(duration_cast<nanoseconds>(now.time_since_epoch()).count(), memory_order_relaxed);
+	register_snapshot_seq.store(seq + 2, memory_order_release);
+
+	register_read_in_flight = false;
+	next_register_read = now + milliseconds(register_poll_interval_ms.load(memory_order_relaxed));
+}
+
+RegisterSnapshot BMUSBCapture::get_register_snapshot() const
+{
+	RegisterSnapshot snapshot;
+	uint32_t seq_before, seq_after;
+	do {
+		seq_before = register_snapshot_seq.load(memory_order_acquire);
+		for (int i = 0; i < NUM_BMUSB_REGISTERS / 4; ++i) {
+			uint32_t word = register_snapshot_words[i].load(memory_order_relaxed);
+			memcpy(snapshot.registers + i * 4, &word, sizeof(word));
+		}
+		snapshot.passes = register_snapshot_passes.load(memory_order_relaxed);
+		snapshot.read_at = steady_clock::time_point(nanoseconds(register_snapshot_time_ns.load(memory_order_relaxed)));
+		atomic_thread_fence(memory_order_acquire);
+		seq_after = register_snapshot_seq.load(memory_order_relaxed);
+	} while ((seq_before & 1) != 0 || seq_before != seq_after);
+	return snapshot;
+}
+
+void BMUSBCapture::decode_transfer(TransferState *xfr_state)
+{
+	libusb_transfer *xfr = xfr_state->xfr;
+	xfr_state->refcount = 1;
+
+	unsigned generation = recovery_generation.load(memory_order_acquire);
+	if (generation != decoded_recovery_generation) {
+		decoded_recovery_generation = generation;
+		resync_after_recovery();
+	}
+
+	PacketCounts counts;
+	if (xfr->endpoint == 0x84) {
+		decode_packs<AudioEndpoint>(xfr_state, &counts);
+	} else {
+		decode_packs<VideoEndpoint>(xfr_state, &counts);
+		video_errored_packets += counts.errored_packets;
+		if (adaptive_transfers) {
+			update_video_transfer_depth(counts.errored_packets);
+		}
+		if (auto_packet_size) {
+			tune_video_packet_size(counts);
+		}
+	}
+
+	// Zero-copy frames might still be pointing into the buffer;
+	// if so, whoever releases the last of them will resubmit it.
+	release_transfer(xfr_state);
+}
+
+// Called by the thread that decodes, for the first transfer after
+// recover_from_error(). Whatever came in between is lost, so we cannot
+// trust our position in the stream, like after an errored packet.
+void BMUSBCapture::resync_after_recovery()
+{
+	for (SyncState *sync : { &video_sync, &audio_sync }) {
+		sync->partial_sync_bytes = 0;
+		sync->locked = false;
+	}
+	++current_video_frame.metadata.errored_packets;
+	++current_audio_frame.metadata.errored_packets;
+	awaiting_frame_after_recovery = true;
+}
+
+void BMUSBCapture::decode_thread_func()
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "bmusb_decode_%d", card_index);
+	pthread_setname_np(pthread_self(), thread_name);
+	apply_thread_scheduling(decode_thread_scheduling, thread_name);
+
+	for ( ;; ) {
+		if (sem_wait(&completed_xfrs_sem) == -1) {
+			assert(errno == EINTR);
+			continue;
+		}
+		if (decode_thread_should_quit) {
+			break;
+		}
+		TransferState *xfr_state = completed_xfrs.pop();
+		assert(xfr_state != nullptr);
+		decode_transfer(xfr_state);
+	}
+}
+
+void BMUSBCapture::release_transfer(TransferState *xfr_state)
+{
+	if (--xfr_state->refcount > 0) {
+		return;
+	}
+
+	libusb_transfer *xfr = xfr_state->xfr;
+	if (xfr->endpoint != 0x84 && adaptive_transfers) {
+		int64_t latency_ns = duration_cast<nanoseconds>(steady_clock::now() - xfr_state->completed_at).count();
+		int64_t old_max = max_resubmit_latency_ns.load(memory_order_relaxed);
+		while (latency_ns > old_max &&
+		       !max_resubmit_latency_ns.compare_exchange_weak(old_max, latency_ns, memory_order_relaxed)) {
+		}
+
+		// See if the controller wants us to take this one out of circulation.
+		int to_retire = video_transfers_to_retire.load();
+		if (to_retire > 0 && video_transfers_to_retire.compare_exchange_strong(to_retire, to_retire - 1)) {
+			lock_guard<mutex> lock(parked_video_xfrs_mutex);
+			xfr_state->parked = true;
+			parked_video_xfrs.push_back(xfr_state);
+			--active_video_transfers;
+			return;
+		}
+	}
+	submit_transfer(xfr_state);
+}
+
+void BMUSBCapture::submit_transfer(TransferState *xfr_state)
+{
+	if (recovering.load(memory_order_acquire)) {
+		lock_guard<mutex> lock(recovery_mutex);
+		if (recovering) {
+			idle_xfrs.push_back(xfr_state);
+			return;
+		}
+	}
+
+	libusb_transfer *xfr = xfr_state->xfr;
+	if (xfr->endpoint != 0x84) {
+		// See update_video_mode().
+		unsigned generation = video_xfr_layout_generation.load(memory_order_acquire);
+		if (xfr_state->layout_generation != generation) {
+			change_xfer_packet_size(video_packet_size.load(memory_order_relaxed), xfr);
+			xfr_state->layout_generation = generation;
+		}
+	}
+	++xfrs_in_flight;
+	int rc = libusb_submit_transfer(xfr);
+	if (rc < 0) {
+		--xfrs_in_flight;
+		request_recovery(rc);
+		submit_transfer(xfr_state);  // Sets it aside.
+	}
+}
+
+// Can be called from any thread, and never blocks for long.
+void BMUSBCapture::request_recovery(int error)
+{
+	if (recovering.exchange(true)) {
+		return;  // Already on it.
+	}
+	recovery_start_ns = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+	last_recovery_error = error;
+	lock_guard<mutex> lock(recovery_mutex);
+	recovery_requested = true;
+	recovery_cv.notify_all();
+}
+
+void BMUSBCapture::recovery_thread_func()
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "bmusb_recover_%d", card_index);
+	pthread_setname_np(pthread_self(), thread_name);
+
+	for ( ;; ) {
+		{
+			unique_lock<mutex> lock(recovery_mutex);
+			recovery_cv.wait(lock, [this]{ return recovery_requested || recovery_thread_should_quit; });
+			if (recovery_thread_should_quit) {
 				return;
 			}
-			queue_frame(format, timecode, fake_audio_frame, &pending_audio_frames);
+			recovery_requested = false;
 		}
-		queue_frame(format, timecode, current_video_frame, &pending_video_frames);
+		log_message(LogLevel_Warning, "USB transfer error (%d), recovering", last_recovery_error.load());
 
-		VideoFormat video_format;
-		if (decode_video_format(format, &video_format)) {
-			assumed_frame_width = video_format.width;
+		// Retry a few times, in case the card is just slow to come back.
+		bool ok = false;
+		for (int attempt = 0; attempt < 3 && !ok && !recovery_thread_should_quit; ++attempt) {
+			if (attempt > 0) {
+				this_thread::sleep_for(milliseconds(50 * attempt));
+			}
+			ok = recover_from_error();
+		}
+		if (!ok) {
+			// Leave the transfers idle; there is nothing more we can do.
+			++failed_recoveries;
+			log_message(LogLevel_Error, "Could not recover from USB transfer error, giving up on the card");
+			if (!disconnected) {
+				disconnected = true;
+				if (card_disconnected_callback) {
+					card_disconnected_callback();
+				}
+			}
+			return;
 		}
 	}
-
-	current_video_frame = video_frame_allocator->alloc_frame();
 }
 
-void BMUSBCapture::start_new_audio_block(const uint8_t *start)
+// Cancels everything in flight, resets the alternate setting (which resets
+// the isochronous endpoints), and resubmits everything. The thread that
+// decodes then resyncs (see resync_after_recovery()). Returns false if it
+// could not get the card back into a state where that can work.
+bool BMUSBCapture::recover_from_error()
 {
-	uint16_t format = (start[3] << 8) | start[2];
-	uint16_t timecode = (start[1] << 8) | start[0];
-	if (current_audio_frame.len > 0) {
-		current_audio_frame.received_timestamp = steady_clock::now();
-		queue_frame(format, timecode, current_audio_frame, &pending_audio_frames);
+	// Transfers can be submitted (by whoever saw <recovering> just before
+	// it was set) while we cancel, so keep at it until nothing is left.
+	steady_clock::time_point deadline = steady_clock::now() + seconds(1);
+	{
+		unique_lock<mutex> lock(recovery_mutex);
+		while (xfrs_in_flight > 0 || register_read_in_flight) {
+			lock.unlock();
+			for (libusb_transfer *xfr : iso_xfrs) {
+				libusb_cancel_transfer(xfr);
+			}
+			libusb_cancel_transfer(register_xfr);
+			lock.lock();
+			recovery_cv.wait_for(lock, milliseconds(10));
+			if (steady_clock::now() > deadline || recovery_thread_should_quit) {
+				return false;
+			}
+		}
 	}
-	current_audio_frame = audio_frame_allocator->alloc_frame();
-}
 
-void memcpy_interleaved(uint8_t *dest1, uint8_t *dest2, const uint8_t *src, size_t n)
-{
-	assert(n % 2 == 0);
-	uint8_t *dptr1 = dest1;
-	uint8_t *dptr2 = dest2;
+	int rc = libusb_set_interface_alt_setting(devh, 0, 1);
+	if (rc >= 0) {
+		rc = libusb_set_interface_alt_setting(devh, 0, 2);
+	}
+	if (rc >= 0) {
+		rc = send_capture_mode();
+	}
+	if (rc < 0) {
+		log_message(LogLevel_Warning, "Error resetting the card: %s", libusb_error_name(rc));
+		return false;
+	}
 
-	for (size_t i = 0; i < n; i += 2) {
-		*dptr1++ = *src++;
-		*dptr2++ = *src++;
+	recovery_generation.fetch_add(1, memory_order_release);
+	vector<TransferState *> xfrs_to_submit;
+	{
+		lock_guard<mutex> lock(recovery_mutex);
+		swap(xfrs_to_submit, idle_xfrs);
+		recovering = false;
 	}
+	for (TransferState *xfr_state : xfrs_to_submit) {
+		submit_transfer(xfr_state);
+	}
+	return true;
 }
 
-void add_to_frame(FrameAllocator::Frame *current_frame, const char *frame_type_name, const uint8_t *start, const uint8_t *end)
+void BMUSBCapture::PacketCounters::add(const PacketCounts &counts)
 {
-	if (current_frame->data == nullptr ||
-	    current_frame->len > current_frame->size ||
-	    start == end) {
-		return;
+	// There is only one writer, so no need for atomic read-modify-write.
+	auto bump = [](atomic<uint64_t> *counter, uint64_t n) {
+		counter->store(counter->load(memory_order_relaxed) + n, memory_order_relaxed);
+	};
+	bump(&packets, counts.packets);
+	bump(&full_packets, counts.full_packets);
+	bump(&errored_packets, counts.errored_packets);
+	bump(&overflowed_packets, counts.overflowed_packets);
+	bump(&bytes, counts.bytes);
+	bump(&requested_bytes, counts.requested_bytes);
+	if (counts.max_packet_bytes > max_packet_bytes.load(memory_order_relaxed)) {
+		max_packet_bytes.store(counts.max_packet_bytes, memory_order_relaxed);
 	}
+}
 
-	int bytes = end - start;
-	if (current_frame->len + bytes > current_frame->size) {
-		current_frame->overflow = current_frame->len + bytes - current_frame->size;
-		current_frame->len = current_frame->size;
-		if (current_frame->overflow > 1048576) {
-			printf("%d bytes overflow after last %s frame\n",
-				int(current_frame->overflow), frame_type_name);
-			current_frame->overflow = 0;
-		}
-	} else {
-		if (current_frame->data_copy != nullptr) {
-			memcpy(current_frame->data_copy + current_frame->len, start, bytes);
-		}
-		if (current_frame->interleaved) {
-			uint8_t *data = current_frame->data + current_frame->len / 2;
-			uint8_t *data2 = current_frame->data2 + current_frame->len / 2;
-			if (current_frame->len % 2 == 1) {
-				++data;
-				swap(data, data2);
-			}
-			if (bytes % 2 == 1) {
-				*data++ = *start++;
-				swap(data, data2);
-				++current_frame->len;
-				--bytes;
-			}
-			memcpy_interleaved(data, data2, start, bytes);
-			current_frame->len += bytes;
-		} else {
-			memcpy(current_frame->data + current_frame->len, start, bytes);
-			current_frame->len += bytes;
-		}
-	}
+PacketStats BMUSBCapture::PacketCounters::get() const
+{
+	PacketStats stats;
+	stats.packets = packets.load(memory_order_relaxed);
+	stats.full_packets = full_packets.load(memory_order_relaxed);
+	stats.errored_packets = errored_packets.load(memory_order_relaxed);
+	stats.overflowed_packets = overflowed_packets.load(memory_order_relaxed);
+	stats.bytes = bytes.load(memory_order_relaxed);
+	stats.requested_bytes = requested_bytes.load(memory_order_relaxed);
+	stats.max_packet_bytes = max_packet_bytes.load(memory_order_relaxed);
+	return stats;
 }
 
-const uint8_t *add_to_frame_fastpath(FrameAllocator::Frame *current_frame, const uint8_t *start, const uint8_t *limit, const char sync_char)
+PacketStats BMUSBCapture::get_video_packet_stats() const
 {
-    // DISABLED AVX2/SSE: Always return start to use the standard slow path.
-    return start;
+	PacketStats stats = video_packet_counters.get();
+	stats.packet_size = video_packet_size.load(memory_order_relaxed);
+	return stats;
 }
 
-void decode_packs(const libusb_transfer *xfr,
-                  const char *sync_pattern,
-                  int sync_length,
-                  FrameAllocator::Frame *current_frame,
-                  const char *frame_type_name,
-                  function<void(const uint8_t *start)> start_callback)
+PacketStats BMUSBCapture::get_audio_packet_stats() const
 {
-	int offset = 0;
-	for (int i = 0; i < xfr->num_iso_packets; i++) {
-		const libusb_iso_packet_descriptor *pack = &xfr->iso_packet_desc[i];
+	PacketStats stats = audio_packet_counters.get();
+	stats.packet_size = AUDIO_PACKET_SIZE;
+	return stats;
+}
 
-		if (pack->status != LIBUSB_TRANSFER_COMPLETED) {
-            // --- DEBUG ADDITION ---
-            // Print exactly what happened:
-            // Status 6 = Overflow (Hardware sent more bytes than 'Length')
-            // Actual_Length = How many bytes the hardware TRIED to send
-			fprintf(stderr, "[ERROR] Pack %u/%u Status %d | ReqLen: %u | ActLen: %u\n", 
-                i, xfr->num_iso_packets, pack->status, pack->length, pack->actual_length);
-			continue;
+// The card sends more or less the same amount of data in every packet for
+// a given mode, so after a window of traffic without trouble, we size the
+// packets to the largest one we saw, plus some headroom. If that turns out
+// to be too small after all, we only lose a few packets before we go back
+// to the default size (which find_xfer_size_for_width() has been tuned to
+// be safe) and remember not to go that low again.
+void BMUSBCapture::tune_video_packet_size(const PacketCounts &counts)
+{
+	constexpr unsigned packets_per_window = 8000;  // About a second of microframes.
+
+	const size_t current_size = video_packet_size.load(memory_order_relaxed);
+	const size_t default_size = find_xfer_size_for_width(current_pixel_format, assumed_frame_width);
+	if (counts.overflowed_packets > 0) {
+		// Transfers that went out before we last grew can still overflow;
+		// only react if the current size is one we picked.
+		if (current_size < default_size) {
+			min_tuned_packet_size = min(current_size + MIN_VIDEO_PACKET_SIZE, default_size);
+			set_video_packet_size(default_size);
+			log_message(LogLevel_Debug, "Packets of %zu bytes overflow; back to %zu bytes, never below %zu",
+				current_size, default_size, min_tuned_packet_size);
 		}
+		tune_window_packets = 0;
+		tune_window_max_packet_bytes = 0;
+		return;
+	}
 
-		const uint8_t *start = xfr->buffer + offset;
-		const uint8_t *limit = start + pack->actual_length;
-		while (start < limit) { 
-			start = add_to_frame_fastpath(current_frame, start, limit, sync_pattern[0]);
-			if (start == limit) break;
-			assert(start < limit);
+	tune_window_max_packet_bytes = max(tune_window_max_packet_bytes, counts.max_packet_bytes);
+	tune_window_packets += counts.packets;
+	if (tune_window_packets < packets_per_window) {
+		return;
+	}
 
-			const unsigned char* start_next_frame = (const unsigned char *)memmem(start, limit - start, sync_pattern, sync_length);
-			if (start_next_frame == nullptr) {
-				add_to_frame(current_frame, frame_type_name, start, limit);
-				break;
-			} else {
-				add_to_frame(current_frame, frame_type_name, start, start_next_frame);
-				start = start_next_frame + sync_length;  
-				start_callback(start);
-			}
-		}
-		offset += pack->length;
+	size_t size = tune_window_max_packet_bytes + tune_window_max_packet_bytes / 4;
+	size = (size + MIN_VIDEO_PACKET_SIZE - 1) / MIN_VIDEO_PACKET_SIZE * MIN_VIDEO_PACKET_SIZE;
+	// Zero-copy frames need a span per packet, so they can't have too many.
+	const size_t min_size = zero_copy_video ? video_transfer_size / 16 : MIN_VIDEO_PACKET_SIZE;
+	size = max<size_t>(size, max<size_t>(min_tuned_packet_size, min_size));
+	if (size < current_size) {
+		set_video_packet_size(size);
+		log_message(LogLevel_Debug, "Largest video packet was %zu bytes; now asking for %zu bytes per packet",
+			tune_window_max_packet_bytes, size);
 	}
+	tune_window_packets = 0;
+	tune_window_max_packet_bytes = 0;
 }
 
-void BMUSBCapture::cb_xfr(struct libusb_transfer *xfr)
+// A simple controller for the number of video transfers in circulation.
+// Every so often, it looks at how long transfers have been kept away from
+// the card between completion and resubmit, compared to how long the rest
+// of the transfers last, and whether any packets have been lost. If we are
+// cutting it close, it puts more transfers into circulation; if we have had
+// lots of slack for a long time, it slowly takes them out again.
+void BMUSBCapture::update_video_transfer_depth(int num_errors)
 {
-	if (xfr->status != LIBUSB_TRANSFER_COMPLETED &&
-	    xfr->status != LIBUSB_TRANSFER_NO_DEVICE) {
-		fprintf(stderr, "error: transfer status %d\n", xfr->status);
-		libusb_free_transfer(xfr);
-		exit(3);
-	}
-
-	assert(xfr->user_data != nullptr);
-	BMUSBCapture *usb = static_cast<BMUSBCapture *>(xfr->user_data);
+	constexpr unsigned completions_per_window = 64;
+	constexpr unsigned calm_windows_before_shrinking = 20;
 
-	if (xfr->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		if (!usb->disconnected) {
-			fprintf(stderr, "Device went away, stopping transfers.\n");
-			usb->disconnected = true;
-			if (usb->card_disconnected_callback) {
-				usb->card_disconnected_callback();
-			}
-		}
+	steady_clock::time_point now = steady_clock::now();
+	if (depth_window_completions++ == 0) {
+		depth_window_start = now;
+	}
+	depth_window_errors += num_errors;
+	if (depth_window_completions < completions_per_window) {
 		return;
 	}
 
-	if (xfr->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-		if (xfr->endpoint == 0x84) {
-			decode_packs(xfr, "DeckLinkAudioResyncT", 20, &usb->current_audio_frame, "audio", bind(&BMUSBCapture::start_new_audio_block, usb, _1));
-		} else {
-			decode_packs(xfr, "\x00\x00\xff\xff", 4, &usb->current_video_frame, "video", bind(&BMUSBCapture::start_new_frame, usb, _1));
-			change_xfer_size_for_width(usb->current_pixel_format, usb->assumed_frame_width, xfr);
-		}
-	}
-	if (xfr->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
-		uint8_t *buf = libusb_control_transfer_get_data(xfr);
-		memcpy(usb->register_file + usb->current_register, buf, 4);
-		usb->current_register = (usb->current_register + 4) % NUM_BMUSB_REGISTERS;
-		if (usb->current_register == 0) {
-			printf("register dump:");
-			for (int i = 0; i < NUM_BMUSB_REGISTERS; i += 4) {
-				printf(" 0x%02x%02x%02x%02x", usb->register_file[i], usb->register_file[i + 1], usb->register_file[i + 2], usb->register_file[i + 3]);
+	// How long a completed transfer can be held before the card
+	// runs out of the others.
+	int active = active_video_transfers;
+	double ns_per_transfer = duration<double, nano>(now - depth_window_start).count() / (depth_window_completions - 1);
+	double budget_ns = ns_per_transfer * max(active - 1, 1);
+	int64_t max_latency_ns = max_resubmit_latency_ns.exchange(0);
+
+	if (depth_window_errors > 0 || max_latency_ns > budget_ns / 2) {
+		calm_depth_windows = 0;
+		video_transfers_to_retire = 0;
+		lock_guard<mutex> lock(parked_video_xfrs_mutex);
+		if (!parked_video_xfrs.empty()) {
+			for (int i = 0; i < 2 && !parked_video_xfrs.empty(); ++i) {
+				TransferState *xfr_state = parked_video_xfrs.back();
+				parked_video_xfrs.pop_back();
+				xfr_state->parked = false;
+				++active_video_transfers;
+				submit_transfer(xfr_state);
 			}
-			printf("\n");
+			log_message(LogLevel_Debug, "%u errors, max resubmit latency %.1f ms; now %d video transfers in flight",
+				depth_window_errors, max_latency_ns * 1e-6, int(active_video_transfers));
 		}
-		libusb_fill_control_setup(xfr->buffer,
-		    LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 214, 0,
-			usb->current_register, 4);
+	} else if (max_latency_ns < budget_ns / 8 && active - video_transfers_to_retire > min_active_video_transfers) {
+		if (++calm_depth_windows >= calm_windows_before_shrinking) {
+			calm_depth_windows = 0;
+			++video_transfers_to_retire;
+		}
+	} else {
+		calm_depth_windows = 0;
 	}
 
-	int rc = libusb_submit_transfer(xfr);
-	if (rc < 0) {
-		fprintf(stderr, "error re-submitting URB: %s\n", libusb_error_name(rc));
-		exit(1);
-	}
+	depth_window_completions = 0;
+	depth_window_errors = 0;
 }
 
 int BMUSBCapture::cb_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
@@ -608,7 +2689,7 @@ int BMUSBCapture::cb_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hot
 	if (card_connected_callback != nullptr) {
 		libusb_device_descriptor desc;
                 if (libusb_get_device_descriptor(dev, &desc) < 0) {
-			fprintf(stderr, "Error getting device descriptor for hotplugged device %p, killing hotplug\n", dev);
+			log_message(LogLevel_Error, "Error getting device descriptor for hotplugged device %p, killing hotplug", dev);
 			libusb_unref_device(dev);
 			return 1;
 		}
@@ -625,12 +2706,7 @@ int BMUSBCapture::cb_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hot
 
 void BMUSBCapture::usb_thread_func()
 {
-	sched_param param;
-	memset(&param, 0, sizeof(param));
-	param.sched_priority = 1;
-	if (sched_setscheduler(0, SCHED_RR, &param) == -1) {
-		printf("couldn't set realtime priority for USB thread: %s\n", strerror(errno));
-	}
+	apply_thread_scheduling(shared_usb_thread_scheduling, "USB thread");
 	pthread_setname_np(pthread_self(), "bmusb_usb_drv");
 	while (!should_quit) {
 		timeval sec { 1, 0 };
@@ -670,20 +2746,25 @@ string get_card_description(int id, uint8_t bus, uint8_t port, uint16_t product)
 	return buf;
 }
 
-vector<USBCardDevice> find_all_cards()
+vector<USBCardDevice> find_all_cards(libusb_context *ctx)
 {
 	libusb_device **devices;
-	ssize_t num_devices = libusb_get_device_list(nullptr, &devices);
+	ssize_t num_devices = libusb_get_device_list(ctx, &devices);
 	if (num_devices == -1) {
-		fprintf(stderr, "Error finding USB devices\n");
-		exit(1);
+		throw_error(BMUSBError_NoSuchCard, 0, "Error finding USB devices");
 	}
 	vector<USBCardDevice> found_cards;
 	for (ssize_t i = 0; i < num_devices; ++i) {
 		libusb_device_descriptor desc;
                 if (libusb_get_device_descriptor(devices[i], &desc) < 0) {
-			fprintf(stderr, "Error getting device descriptor for device %d\n", int(i));
-			exit(1);
+			for (ssize_t j = i; j < num_devices; ++j) {
+				libusb_unref_device(devices[j]);
+			}
+			for (const USBCardDevice &card : found_cards) {
+				libusb_unref_device(card.device);
+			}
+			libusb_free_device_list(devices, 0);
+			throw_error(BMUSBError_NoSuchCard, 0, "Error getting device descriptor for device %d", int(i));
 		}
 
 		uint8_t bus = libusb_get_bus_number(devices[i]);
@@ -710,33 +2791,33 @@ vector<USBCardDevice> find_all_cards()
 	return found_cards;
 }
 
-libusb_device_handle *open_card(int card_index, string *description)
+libusb_device_handle *open_card(libusb_context *ctx, int card_index, string *description)
 {
-	vector<USBCardDevice> found_cards = find_all_cards();
+	vector<USBCardDevice> found_cards = find_all_cards(ctx);
 
 	for (size_t i = 0; i < found_cards.size(); ++i) {
 		string tmp_description = get_card_description(i, found_cards[i].bus, found_cards[i].port, found_cards[i].product);
-		fprintf(stderr, "%s\n", tmp_description.c_str());
+		log_message(LogLevel_Info, "%s", tmp_description.c_str());
 		if (i == size_t(card_index)) {
 			*description = tmp_description;
 		}
 	}
 
 	if (size_t(card_index) >= found_cards.size()) {
-		fprintf(stderr, "Could not open card %d (only %d found)\n", card_index, int(found_cards.size()));
-		exit(1);
+		for (size_t i = 0; i < found_cards.size(); ++i) {
+			libusb_unref_device(found_cards[i].device);
+		}
+		throw_error(BMUSBError_NoSuchCard, 0, "Could not open card %d (only %d found)", card_index, int(found_cards.size()));
 	}
 
 	libusb_device_handle *devh;
 	int rc = libusb_open(found_cards[card_index].device, &devh);
-	if (rc < 0) {
-		fprintf(stderr, "Error opening card %d: %s\n", card_index, libusb_error_name(rc));
-		exit(1);
-	}
-
 	for (size_t i = 0; i < found_cards.size(); ++i) {
 		libusb_unref_device(found_cards[i].device);
 	}
+	if (rc < 0) {
+		throw_error(BMUSBError_Open, rc, "Error opening card %d: %s", card_index, libusb_error_name(rc));
+	}
 
 	return devh;
 }
@@ -748,8 +2829,7 @@ libusb_device_handle *open_card(unsigned card_index, libusb_device *dev, string
 
 	libusb_device_descriptor desc;
 	if (libusb_get_device_descriptor(dev, &desc) < 0) {
-		fprintf(stderr, "Error getting device descriptor for device %p\n", dev);
-		exit(1);
+		throw_error(BMUSBError_Open, 0, "Error getting device descriptor for device %p", dev);
 	}
 
 	*description = get_card_description(card_index, bus, port, desc.idProduct);
@@ -757,24 +2837,45 @@ libusb_device_handle *open_card(unsigned card_index, libusb_device *dev, string
 	libusb_device_handle *devh;
 	int rc = libusb_open(dev, &devh);
 	if (rc < 0) {
-		fprintf(stderr, "Error opening card %p: %s\n", dev, libusb_error_name(rc));
-		exit(1);
+		throw_error(BMUSBError_Open, rc, "Error opening card %p: %s", dev, libusb_error_name(rc));
 	}
 
 	return devh;
 }
 
+// Finds <dev> (typically from the default context, through hotplug) in <ctx>.
+// The port number alone is not enough (it is only unique per hub), so we go
+// by the device address, which is unique on its bus for as long as the device
+// stays plugged in. Returns a new reference.
+libusb_device *find_same_card(libusb_context *ctx, libusb_device *dev)
+{
+	uint8_t bus = libusb_get_bus_number(dev);
+	uint8_t address = libusb_get_device_address(dev);
+
+	libusb_device *ret = nullptr;
+	for (const USBCardDevice &card : find_all_cards(ctx)) {
+		if (ret == nullptr && card.bus == bus && libusb_get_device_address(card.device) == address) {
+			ret = card.device;
+		} else {
+			libusb_unref_device(card.device);
+		}
+	}
+	if (ret == nullptr) {
+		throw_error(BMUSBError_NoSuchCard, 0, "Could not find card %p in its own libusb context", dev);
+	}
+	return ret;
+}
+
 }  // namespace
 
 unsigned BMUSBCapture::num_cards()
 {
 	int rc = libusb_init(nullptr);
 	if (rc < 0) {
-		fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rc));
-		exit(1);
+		throw_error(BMUSBError_LibusbInit, rc, "Error initializing libusb: %s", libusb_error_name(rc));
 	}
 
-	vector<USBCardDevice> found_cards = find_all_cards();
+	vector<USBCardDevice> found_cards = find_all_cards(nullptr);
 	unsigned ret = found_cards.size();
 	for (size_t i = 0; i < found_cards.size(); ++i) {
 		libusb_unref_device(found_cards[i].device);
@@ -785,76 +2886,93 @@ unsigned BMUSBCapture::num_cards()
 void BMUSBCapture::set_pixel_format(PixelFormat pixel_format)
 {
 	current_pixel_format = pixel_format;
+	set_video_packet_size(find_xfer_size_for_width(pixel_format, assumed_frame_width));  // The stride changes.
 	update_capture_mode();
 }
 
 void BMUSBCapture::configure_card()
 {
-	if (video_frame_allocator == nullptr) {
-		owned_video_frame_allocator.reset(new MallocFrameAllocator(FRAME_SIZE, NUM_QUEUED_VIDEO_FRAMES));
+	mark_startup(Startup_Begin);
+	if (zero_copy_video) {
+		// One more than the consumer can hold, for the frame in progress.
+		zero_copy_allocator = new ZeroCopyFrameAllocator(zero_copy_max_held_frames + 1);
+		owned_video_frame_allocator.reset(zero_copy_allocator);
+		set_video_frame_allocator(zero_copy_allocator);
+	} else if (video_frame_allocator == nullptr) {
+		owned_video_frame_allocator.reset(new MallocFrameAllocator(FRAME_SIZE, NUM_INITIAL_VIDEO_FRAMES));
 		set_video_frame_allocator(owned_video_frame_allocator.get());
 	}
-	if (audio_frame_allocator == nullptr) {
-		owned_audio_frame_allocator.reset(new MallocFrameAllocator(65536, NUM_QUEUED_AUDIO_FRAMES));
+	if (output_pixel_format != OutputPixelFormat_Native && !zero_copy_video) {
+		frame_converter.reset(new FrameConverter(output_pixel_format));
+	}
+	if (audio_ring_buffer != nullptr) {
+		audio_decoder.reset(new AudioBlockDecoder(audio_ring_buffer));
+		owned_audio_frame_allocator.reset(new EmptyFrameAllocator);
+		set_audio_frame_allocator(owned_audio_frame_allocator.get());
+	} else if (audio_frame_allocator == nullptr) {
+		owned_audio_frame_allocator.reset(new MallocFrameAllocator(65536, NUM_INITIAL_AUDIO_FRAMES));
 		set_audio_frame_allocator(owned_audio_frame_allocator.get());
 	}
+	warmup_thread_should_quit = false;
+	warmup_thread = thread(&BMUSBCapture::warmup_thread_func, this);
 	dequeue_thread_should_quit = false;
 	dequeue_thread = thread(&BMUSBCapture::dequeue_thread_func, this);
+	mark_startup(Startup_FramePoolsCreated);
 
 	int rc;
 	struct libusb_transfer *xfr;
 
-	rc = libusb_init(nullptr);
+	rc = libusb_init(own_usb_context ? &usb_ctx : nullptr);
 	if (rc < 0) {
-		fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rc));
-		exit(1);
+		throw_error(BMUSBError_LibusbInit, rc, "Error initializing libusb: %s", libusb_error_name(rc));
 	}
+	mark_startup(Startup_LibusbInit);
 
+	if (dev != nullptr && usb_ctx != nullptr) {
+		libusb_device *own_dev = find_same_card(usb_ctx, dev);
+		libusb_unref_device(dev);
+		dev = own_dev;
+	}
 	if (dev == nullptr) {
-		devh = open_card(card_index, &description);
+		devh = open_card(usb_ctx, card_index, &description);
 	} else {
 		devh = open_card(card_index, dev, &description);
 		libusb_unref_device(dev);
 	}
 	if (!devh) {
-		fprintf(stderr, "Error finding USB device\n");
-		exit(1);
+		throw_error(BMUSBError_NoSuchCard, 0, "Error finding USB device");
 	}
+	mark_startup(Startup_CardOpened);
 
 	libusb_config_descriptor *config;
 	rc = libusb_get_config_descriptor(libusb_get_device(devh), 0, &config);
 	if (rc < 0) {
-		fprintf(stderr, "Error getting configuration: %s\n", libusb_error_name(rc));
-		exit(1);
+		throw_error(BMUSBError_Configure, rc, "Error getting configuration: %s", libusb_error_name(rc));
 	}
 
 	rc = libusb_set_configuration(devh, 1);
 	if (rc < 0) {
-		fprintf(stderr, "Error setting configuration 1: %s\n", libusb_error_name(rc));
-		exit(1);
+		throw_error(BMUSBError_Configure, rc, "Error setting configuration 1: %s", libusb_error_name(rc));
 	}
 
 	rc = libusb_claim_interface(devh, 0);
 	if (rc < 0) {
-		fprintf(stderr, "Error claiming interface 0: %s\n", libusb_error_name(rc));
-		exit(1);
+		throw_error(BMUSBError_Configure, rc, "Error claiming interface 0: %s", libusb_error_name(rc));
 	}
 
 	rc = libusb_set_interface_alt_setting(devh, 0, 1);
 	if (rc < 0) {
-		fprintf(stderr, "Error setting alternate 1: %s\n", libusb_error_name(rc));
-		if (rc == LIBUSB_ERROR_NOT_FOUND) {
-			fprintf(stderr, "This is usually because the card came up in USB2 mode.\n");
-			fprintf(stderr, "In particular, this tends to happen if you boot up with the\n");
-			fprintf(stderr, "card plugged in; just unplug and replug it, and it usually works.\n");
-		}
-		exit(1);
+		throw_error(BMUSBError_Configure, rc, "Error setting alternate 1: %s%s", libusb_error_name(rc),
+			(rc != LIBUSB_ERROR_NOT_FOUND) ? "" :
+			" (This is usually because the card came up in USB2 mode. In particular,"
+			" this tends to happen if you boot up with the card plugged in; just unplug"
+			" and replug it, and it usually works.)");
 	}
 	rc = libusb_set_interface_alt_setting(devh, 0, 2);
 	if (rc < 0) {
-		fprintf(stderr, "Error setting alternate 2: %s\n", libusb_error_name(rc));
-		exit(1);
+		throw_error(BMUSBError_Configure, rc, "Error setting alternate 2: %s", libusb_error_name(rc));
 	}
+	mark_startup(Startup_InterfaceSet);
 
 	update_capture_mode();
 
@@ -879,36 +2997,58 @@ void BMUSBCapture::configure_card()
 		rc = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR | ctrls[req].endpoint,
 			ctrls[req].request, 0, ctrls[req].index, value, size, 0);
 		if (rc < 0) {
-			fprintf(stderr, "Error on control %d: %s\n", ctrls[req].index, libusb_error_name(rc));
-			exit(1);
+			throw_error(BMUSBError_Control, rc, "Error on control %d: %s", ctrls[req].index, libusb_error_name(rc));
 		}
 
 		if (ctrls[req].index == 16 && rc == 4) {
-			printf("Card firmware version: 0x%02x%02x\n", value[2], value[3]);
+			log_message(LogLevel_Info, "Card firmware version: 0x%02x%02x", value[2], value[3]);
 		}
 	}
+	mark_startup(Startup_ControlTransfersDone);
 
-	static uint8_t cmdbuf3[LIBUSB_CONTROL_SETUP_SIZE + 4];
-	static int completed3 = 0;
-
-	xfr = libusb_alloc_transfer(0);
-	libusb_fill_control_setup(cmdbuf3,
-	    LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 214, 0,
-		current_register, 4);
-	libusb_fill_control_transfer(xfr, devh, cmdbuf3, cb_xfr, &completed3, 0);
-	xfr->user_data = this;
+	// For the register reads; the setup is filled in anew for each
+	// register when the transfer is submitted.
+	register_xfr = libusb_alloc_transfer(0);
+	libusb_fill_control_setup(register_xfr_buf,
+	    LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 214, 0, 0, 4);
+	libusb_fill_control_transfer(register_xfr, devh, register_xfr_buf, cb_xfr, this, 0);
 
+	video_packet_size = find_xfer_size_for_width(current_pixel_format, assumed_frame_width);
 	for (int e = 3; e <= 4; ++e) {
-		int num_transfers = 6;
+		int num_transfers = (e == 3) ? num_video_transfers : num_audio_transfers;
+		if (use_decode_thread) {
+			// Completed transfers wait for the decode thread before they
+			// are resubmitted, so keep some spare ones to keep the pipe full.
+			num_transfers *= 2;
+		}
+		if (e == 3 && zero_copy_video) {
+			// Frames being assembled, queued or held by the consumer all
+			// keep their transfers from being resubmitted, so we need enough
+			// extra to keep the same number in flight. A frame can start
+			// and end in the middle of a transfer, hence the extra one.
+			int transfers_per_frame = (MAX_VIDEO_FRAME_BYTES + video_transfer_size - 1) / video_transfer_size + 1;
+			num_transfers += (zero_copy_max_held_frames + 1) * transfers_per_frame;
+		}
+
+		// With adaptive depth, we allocate everything up front and keep
+		// the ones we don't need right now parked, so that we never need
+		// to allocate anything from the USB thread.
+		int num_active_transfers = num_transfers;
+		if (e == 3 && adaptive_transfers) {
+			num_transfers += max(0, int(max_extra_video_transfers));
+			min_active_video_transfers = num_active_transfers;
+			active_video_transfers = num_active_transfers;
+		}
+
 		for (int i = 0; i < num_transfers; ++i) {
 			size_t buf_size;
 			int num_iso_pack, size;
 			if (e == 3) {
 				size = find_xfer_size_for_width(PixelFormat_8BitYCbCr, MIN_WIDTH);
-				num_iso_pack = USB_VIDEO_TRANSFER_SIZE / size;
-				buf_size = USB_VIDEO_TRANSFER_SIZE;
+				num_iso_pack = video_transfer_size / size;
+				buf_size = video_transfer_size;
 			} else {
-				size = 0xc0;
+				size = AUDIO_PACKET_SIZE;
 				num_iso_pack = 80;
 				buf_size = num_iso_pack * size;
 			}
@@ -920,53 +3060,287 @@ void BMUSBCapture::configure_card()
 			uint8_t *buf = nullptr;
 #endif
 			if (buf == nullptr) {
-				fprintf(stderr, "Failed to allocate persistent DMA memory ");
-				fprintf(stderr, "Will go slower, and likely fail due to memory fragmentation after a few hours.\n");
+				static LogRateLimit rate_limit;
+				log_rate_limited(&rate_limit, LogLevel_Warning, "Failed to allocate persistent DMA memory. "
+					"Will go slower, and likely fail due to memory fragmentation after a few hours.");
 				buf = new uint8_t[num_bytes];
 			}
 
-			xfr = libusb_alloc_transfer(num_iso_pack);
+			// Video transfers can get smaller packets later; see change_xfer_packet_size().
+			xfr = libusb_alloc_transfer((e == 3) ? video_transfer_size / MIN_VIDEO_PACKET_SIZE : num_iso_pack);
 			if (!xfr) {
-				fprintf(stderr, "oom\n");
-				exit(1);
+				throw_error(BMUSBError_OutOfMemory, 0, "Could not allocate transfer");
 			}
 
 			int ep = LIBUSB_ENDPOINT_IN | e;
 			libusb_fill_iso_transfer(xfr, devh, ep, buf, buf_size,
 				num_iso_pack, cb_xfr, nullptr, 0);
 			libusb_set_iso_packet_lengths(xfr, size);
-			xfr->user_data = this;
+
+			iso_xfr_states.emplace_back(new TransferState);
+			iso_xfr_states.back()->card = this;
+			iso_xfr_states.back()->xfr = xfr;
+			xfr->user_data = iso_xfr_states.back().get();
 
 			if (e == 3) {
-				change_xfer_size_for_width(current_pixel_format, assumed_frame_width, xfr);
+				change_xfer_packet_size(video_packet_size, xfr);
+			}
+			if (i >= num_active_transfers) {
+				iso_xfr_states.back()->parked = true;
+				parked_video_xfrs.push_back(iso_xfr_states.back().get());
 			}
 
 			iso_xfrs.push_back(xfr);
 		}
 	}
+	mark_startup(Startup_TransfersAllocated);
+
+	// Capture must not start into the frame pools while they are still
+	// being paged in, but usually that finished long ago.
+	{
+		unique_lock<mutex> lock(warmup_mutex);
+		warmup_cv.wait(lock, [this]{ return frame_pools_warm; });
+	}
+
+	if (use_decode_thread) {
+		completed_xfrs.init(iso_xfrs.size());
+		sem_init(&completed_xfrs_sem, 0, 0);
+		completed_xfrs_sem_initialized = true;
+		decode_thread_should_quit = false;
+		decode_thread = thread(&BMUSBCapture::decode_thread_func, this);
+	}
+	recovery_thread_should_quit = false;
+	recovery_thread = thread(&BMUSBCapture::recovery_thread_func, this);
+
+	// The frames in our own pools are paged in already, and so will
+	// the ones they grow by be (see warmup_thread_func()).
+	if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		log_message(LogLevel_Warning, "couldn't lock memory: %s; only prefaulting frames", strerror(errno));
+	}
+	mark_startup(Startup_Configured);
+}
+
+// Pages in the frames the pools start out with while configure_card()
+// brings up USB, and then, once the first frame has been delivered, grows
+// the pools to their full size. Neither has to hold up the first frame.
+void BMUSBCapture::warmup_thread_func()
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "bmusb_warmup_%d", card_index);
+	pthread_setname_np(pthread_self(), thread_name);
+
+	MallocFrameAllocator *video_allocator = dynamic_cast<MallocFrameAllocator *>(owned_video_frame_allocator.get());
+	MallocFrameAllocator *audio_allocator = dynamic_cast<MallocFrameAllocator *>(owned_audio_frame_allocator.get());
+	if (video_allocator != nullptr) {
+		video_allocator->prefault();
+	}
+	if (audio_allocator != nullptr) {
+		audio_allocator->prefault();
+	}
+	mark_startup(Startup_FramePoolsWarm);
+	{
+		lock_guard<mutex> lock(warmup_mutex);
+		frame_pools_warm = true;
+	}
+	warmup_cv.notify_all();
+
+	{
+		unique_lock<mutex> lock(warmup_mutex);
+		warmup_cv.wait(lock, [this]{ return first_frame_delivered || warmup_thread_should_quit; });
+	}
+
+	// One frame at a time, so that we can stop quickly. If memory could
+	// not be locked, these would not be paged in by mlockall() either.
+	// Running out of memory (with everything locked, RLIMIT_MEMLOCK is
+	// the usual limit) is not fatal; we just capture with smaller pools.
+	bool grown = true;
+	for (int i = NUM_INITIAL_VIDEO_FRAMES; i < NUM_QUEUED_VIDEO_FRAMES && video_allocator != nullptr; ++i) {
+		if (warmup_thread_should_quit) return;
+		if (!video_allocator->add_frames(1, lock_memory)) {
+			log_message(LogLevel_Warning, "Out of memory growing the video frame pool; keeping it at %d frames", i);
+			grown = false;
+			break;
+		}
+	}
+	for (int i = NUM_INITIAL_AUDIO_FRAMES; i < NUM_QUEUED_AUDIO_FRAMES && audio_allocator != nullptr; ++i) {
+		if (warmup_thread_should_quit) return;
+		if (!audio_allocator->add_frames(1, lock_memory)) {
+			log_message(LogLevel_Warning, "Out of memory growing the audio frame pool; keeping it at %d frames", i);
+			grown = false;
+			break;
+		}
+	}
+	if (grown) {
+		log_message(LogLevel_Debug, "Frame pools grown to full size");
+	}
+}
+
+void BMUSBCapture::mark_startup(StartupMilestone milestone)
+{
+	startup_ns[milestone].store(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count(), memory_order_relaxed);
+}
+
+StartupStats BMUSBCapture::get_startup_stats() const
+{
+	int64_t t[NUM_STARTUP_MILESTONES];
+	for (int i = 0; i < NUM_STARTUP_MILESTONES; ++i) {
+		t[i] = startup_ns[i].load(memory_order_relaxed);
+	}
+	auto phase = [&t](StartupMilestone from, StartupMilestone to) {
+		return nanoseconds((t[from] == 0 || t[to] == 0) ? 0 : t[to] - t[from]);
+	};
+
+	StartupStats stats;
+	stats.complete = (t[Startup_FirstFrame] != 0);
+	stats.create_frame_pools = phase(Startup_Begin, Startup_FramePoolsCreated);
+	stats.libusb_init = phase(Startup_FramePoolsCreated, Startup_LibusbInit);
+	stats.open_card = phase(Startup_LibusbInit, Startup_CardOpened);
+	stats.set_interface = phase(Startup_CardOpened, Startup_InterfaceSet);
+	stats.control_transfers = phase(Startup_InterfaceSet, Startup_ControlTransfersDone);
+	stats.allocate_transfers = phase(Startup_ControlTransfersDone, Startup_TransfersAllocated);
+	stats.finish_configure = phase(Startup_TransfersAllocated, Startup_Configured);
+	stats.submit_transfers = phase(Startup_SubmitBegin, Startup_Submitted);
+	stats.first_header = phase(Startup_Submitted, Startup_FirstHeader);
+	stats.first_frame = phase(Startup_FirstHeader, Startup_FirstFrame);
+	stats.time_to_first_frame = phase(Startup_Begin, Startup_FirstFrame);
+	stats.frame_pool_warmup = phase(Startup_FramePoolsCreated, Startup_FramePoolsWarm);
+	return stats;
 }
 
 void BMUSBCapture::start_bm_capture()
 {
+	mark_startup(Startup_SubmitBegin);
+	if (usb_ctx != nullptr && !external_event_loop && !card_usb_thread.joinable()) {
+		card_usb_thread_should_quit = false;
+		card_usb_thread = thread(&BMUSBCapture::card_usb_thread_func, this);
+	}
+
 	int i = 0;
 	for (libusb_transfer *xfr : iso_xfrs) {
+		if (static_cast<TransferState *>(xfr->user_data)->parked) {
+			continue;
+		}
+		++xfrs_in_flight;
 		int rc = libusb_submit_transfer(xfr);
 		++i;
 		if (rc < 0) {
-			fprintf(stderr, "Error submitting iso to endpoint 0x%02x, number %d: %s\n",
+			--xfrs_in_flight;
+			throw_error(BMUSBError_Submit, rc, "Error submitting iso to endpoint 0x%02x, number %d: %s",
 				xfr->endpoint, i, libusb_error_name(rc));
-			exit(1);
 		}
 	}
+	mark_startup(Startup_Submitted);
+}
+
+// Like usb_thread_func(), but only for this card's own context.
+void BMUSBCapture::card_usb_thread_func()
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "bmusb_usb_%d", card_index);
+	pthread_setname_np(pthread_self(), thread_name);
+	apply_thread_scheduling(usb_thread_scheduling, thread_name);
+
+	while (!card_usb_thread_should_quit) {
+		timeval sec { 1, 0 };
+		int rc = libusb_handle_events_timeout(usb_ctx, &sec);
+		if (rc != LIBUSB_SUCCESS)
+			break;
+	}
+}
+
+vector<libusb_pollfd> BMUSBCapture::get_pollfds() const
+{
+	assert(usb_ctx != nullptr);
+	vector<libusb_pollfd> ret;
+	const libusb_pollfd **pollfds = libusb_get_pollfds(usb_ctx);
+	if (pollfds != nullptr) {
+		for (const libusb_pollfd **pfd = pollfds; *pfd != nullptr; ++pfd) {
+			ret.push_back(**pfd);
+		}
+		libusb_free_pollfds(pollfds);
+	}
+	return ret;
+}
+
+void BMUSBCapture::set_pollfd_notifiers(function<void(int fd, short events)> added,
+                                        function<void(int fd)> removed)
+{
+	assert(usb_ctx != nullptr);
+	pollfd_added_callback = added;
+	pollfd_removed_callback = removed;
+	libusb_set_pollfd_notifiers(usb_ctx, &BMUSBCapture::cb_pollfd_added, &BMUSBCapture::cb_pollfd_removed, this);
+}
+
+void BMUSBCapture::cb_pollfd_added(int fd, short events, void *user_data)
+{
+	BMUSBCapture *usb = static_cast<BMUSBCapture *>(user_data);
+	if (usb->pollfd_added_callback) {
+		usb->pollfd_added_callback(fd, events);
+	}
+}
+
+void BMUSBCapture::cb_pollfd_removed(int fd, void *user_data)
+{
+	BMUSBCapture *usb = static_cast<BMUSBCapture *>(user_data);
+	if (usb->pollfd_removed_callback) {
+		usb->pollfd_removed_callback(fd);
+	}
+}
+
+bool BMUSBCapture::get_next_timeout(microseconds *timeout) const
+{
+	assert(usb_ctx != nullptr);
+	timeval tv;
+	int rc = libusb_get_next_timeout(usb_ctx, &tv);
+	if (rc == 0) {
+		return false;
+	}
+	if (rc < 0) {
+		// Shouldn't happen; just have them come back right away.
+		tv.tv_sec = tv.tv_usec = 0;
+	}
+	*timeout = seconds(tv.tv_sec) + microseconds(tv.tv_usec);
+	return true;
+}
+
+int BMUSBCapture::process_events()
+{
+	assert(usb_ctx != nullptr);
+	timeval zero { 0, 0 };
+	return libusb_handle_events_timeout_completed(usb_ctx, &zero, nullptr);
 }
 
 void BMUSBCapture::stop_dequeue_thread()
 {
+	stop_decode_thread();
 	dequeue_thread_should_quit = true;
 	queues_not_empty.notify_all();
 	dequeue_thread.join();
 }
 
+void BMUSBCapture::stop_decode_thread()
+{
+	if (!decode_thread.joinable()) {
+		return;
+	}
+	decode_thread_should_quit = true;
+	sem_post(&completed_xfrs_sem);
+	decode_thread.join();
+
+	// The USB thread may still be completing transfers and posting to
+	// completed_xfrs_sem, so it is left for the destructor to destroy.
+}
+
+void BMUSBCapture::set_log_callback(log_callback_t callback)
+{
+	logger()->set_callback(callback);
+}
+
+void BMUSBCapture::set_log_level(LogLevel level)
+{
+	logger()->min_level = level;
+}
+
 void BMUSBCapture::start_bm_thread()
 {
 	if (card_connected_callback != nullptr) {
@@ -974,8 +3348,7 @@ void BMUSBCapture::start_bm_thread()
 			nullptr, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, hotplug_existing_devices ? LIBUSB_HOTPLUG_ENUMERATE : LIBUSB_HOTPLUG_NO_FLAGS,
 			USB_VENDOR_BLACKMAGIC, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
 			&BMUSBCapture::cb_hotplug, nullptr, nullptr) < 0) {
-			fprintf(stderr, "libusb_hotplug_register_callback() failed\n");
-			exit(1);
+			throw_error(BMUSBError_Hotplug, 0, "libusb_hotplug_register_callback() failed");
 		}
 	}
 
@@ -1046,6 +3419,14 @@ void BMUSBCapture::update_capture_mode()
 		return;
 	}
 
+	int rc = send_capture_mode();
+	if (rc < 0) {
+		throw_error(BMUSBError_Control, rc, "Error on setting mode: %s", libusb_error_name(rc));
+	}
+}
+
+int BMUSBCapture::send_capture_mode()
+{
 	uint32_t mode = htonl(0x09000000 | current_video_input | current_audio_input);
 	if (current_pixel_format == PixelFormat_8BitYCbCr) {
 		mode |= htonl(0x20000000);
@@ -1053,23 +3434,46 @@ void BMUSBCapture::update_capture_mode()
 		assert(current_pixel_format == PixelFormat_10BitYCbCr);
 	}
 
-	int rc = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+	return libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
 		215, 0, 0, (unsigned char *)&mode, sizeof(mode), 0);
-	if (rc < 0) {
-		fprintf(stderr, "Error on setting mode: %s\n", libusb_error_name(rc));
-		exit(1);
-	}
+}
+
+BMUSBCapture::BMUSBCapture(int card_index, libusb_device *dev)
+	: card_index(card_index), dev(dev)
+{
 }
 
 BMUSBCapture::~BMUSBCapture() {
     // 1. Ensure threads are stopped explicitly (Safety net)
+    if (warmup_thread.joinable()) {
+        {
+            lock_guard<mutex> lock(warmup_mutex);
+            warmup_thread_should_quit = true;
+        }
+        warmup_cv.notify_all();
+        warmup_thread.join();
+    }
+    if (recovery_thread.joinable()) {
+        {
+            lock_guard<mutex> lock(recovery_mutex);
+            recovery_thread_should_quit = true;
+            recovery_cv.notify_all();
+        }
+        recovery_thread.join();
+    }
+    stop_decode_thread();
     if (dequeue_thread.joinable()) {
         dequeue_thread_should_quit = true;
         queues_not_empty.notify_all();
         dequeue_thread.join();
     }
     
-    if (usb_thread.joinable()) {
+    if (card_usb_thread.joinable()) {
+        // Our own; the other cards are not affected.
+        card_usb_thread_should_quit = true;
+        libusb_interrupt_event_handler(usb_ctx);
+        card_usb_thread.join();
+    } else if (usb_thread.joinable() && usb_ctx == nullptr) {
         should_quit = true;
         libusb_interrupt_event_handler(nullptr);
         usb_thread.join();
@@ -1084,6 +3488,11 @@ BMUSBCapture::~BMUSBCapture() {
         libusb_close(devh);
         devh = nullptr;
     }
+    if (completed_xfrs_sem_initialized) {
+        // No more transfers can complete now.
+        sem_destroy(&completed_xfrs_sem);
+        completed_xfrs_sem_initialized = false;
+    }
 
     // 3. NOW it is safe to free the transfers
     for (libusb_transfer *xfr : iso_xfrs) {
@@ -1094,6 +3503,18 @@ BMUSBCapture::~BMUSBCapture() {
         }
     }
     iso_xfrs.clear();
+    iso_xfr_states.clear();
+    if (register_xfr) {
+        libusb_free_transfer(register_xfr);
+        register_xfr = nullptr;
+    }
+    if (usb_ctx) {
+        if (pollfd_added_callback || pollfd_removed_callback) {
+            libusb_set_pollfd_notifiers(usb_ctx, nullptr, nullptr, nullptr);
+        }
+        libusb_exit(usb_ctx);
+        usb_ctx = nullptr;
+    }
 }
 }  // namespace bmusb 
 
@@ -1,17 +1,23 @@
 #ifndef _BMUSB_H
 #define _BMUSB_H
 
+#include <assert.h>
 #include <libusb.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <stdint.h>
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <stack>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
@@ -20,6 +26,37 @@ namespace bmusb {
 
 class BMUSBCapture;
 
+// A contiguous piece of a scatter-gather frame (see FrameAllocator::Frame::spans).
+struct FrameSpan {
+	const uint8_t *data;
+	size_t len;
+};
+
+// How a frame came in over USB, for measuring latency and jitter, and for
+// connecting bad frames to USB trouble. Bytes that did not fit in the frame
+// are counted in FrameAllocator::Frame::overflow.
+struct FrameMetadata {
+	// When the transfer with the first bytes of the frame completed.
+	// Together with received_timestamp (which is for the last bytes),
+	// this gives how long the frame took to come in.
+	std::chrono::steady_clock::time_point first_packet_timestamp =
+		std::chrono::steady_clock::time_point::min();
+
+	// Isochronous packets that came back with errors (their data is lost)
+	// while the frame was coming in.
+	unsigned errored_packets = 0;
+
+	// Sequence numbers of the first and last transfer the frame was in,
+	// counted per endpoint from when capture started. A frame normally
+	// starts in the transfer the previous one ended in.
+	uint64_t first_transfer_sequence = 0, last_transfer_sequence = 0;
+
+	// If the frame was converted (see BMUSBCapture::set_output_pixel_format()).
+	// Frames without signal or in an unknown mode never are, so consumers
+	// need to be able to handle the native layout anyway.
+	bool converted = false;
+};
+
 // An interface for frame allocators; if you do not specify one
 // (using set_video_frame_allocator), a default one that pre-allocates
 // a freelist of eight frames using new[] will be used. Specifying
@@ -46,6 +83,15 @@ class FrameAllocator {
 		// 10BitYCbCr pixel format.
 		bool interleaved = false;
 
+		// If not nullptr, this is a scatter-gather frame (see
+		// BMUSBCapture::set_zero_copy_video()). <data> is then nullptr,
+		// and the frame consists of the <num_spans> spans, in order,
+		// which point directly into the USB transfer buffers; <len> is
+		// still the total number of bytes. Use copy_from_frame() if you
+		// just want the bytes.
+		const FrameSpan *spans = nullptr;
+		size_t num_spans = 0;
+
 		// At what point this frame was received. Note that this marks the
 		// _end_ of the frame being received, not the beginning.
 		// Thus, if you want to measure latency, you'll also need to include
@@ -53,6 +99,9 @@ class FrameAllocator {
 		// ie., the frames are typically transferred in real time).
 		std::chrono::steady_clock::time_point received_timestamp =
 			std::chrono::steady_clock::time_point::min();
+
+		// Filled in by bmusb for every frame (including empty ones).
+		FrameMetadata metadata;
 	};
 
 	virtual ~FrameAllocator();
@@ -89,9 +138,20 @@ class FrameAllocator {
 		return alloc_frame();
 	}
 
+	// Must also accept empty frames (data == nullptr and spans == nullptr),
+	// which this allocator never handed out; the frame callback gets those
+	// in place of frames that were skipped (see
+	// BMUSBCapture::set_frame_decimation()) or that had an unknown format,
+	// and consumers typically give back every frame they get.
 	virtual void release_frame(Frame frame) = 0;
 };
 
+// Copies <len> bytes starting at <offset> from the given frame into <dest>,
+// regardless of whether it is a regular or a scatter-gather frame.
+// Returns the number of bytes copied, which is less than <len>
+// if the frame is too short.
+size_t copy_from_frame(const FrameAllocator::Frame &frame, size_t offset, uint8_t *dest, size_t len);
+
 // Audio is more important than video, and also much cheaper.
 // By having many more audio frames available, hopefully if something
 // starts to drop, we'll have CPU load go down (from not having to
@@ -99,12 +159,28 @@ class FrameAllocator {
 #define NUM_QUEUED_VIDEO_FRAMES 128
 #define NUM_QUEUED_AUDIO_FRAMES 512
 
+// The pools that BMUSBCapture makes itself start out with only this many
+// frames, which are paged in while configure_card() brings up USB; they
+// are grown to the full sizes above once the first frame has been delivered.
+#define NUM_INITIAL_VIDEO_FRAMES 8
+#define NUM_INITIAL_AUDIO_FRAMES 32
+
 class MallocFrameAllocator : public FrameAllocator {
 public:
 	MallocFrameAllocator(size_t frame_size, size_t num_queued_frames);
 	Frame alloc_frame() override;
 	void release_frame(Frame frame) override;
 
+	// Touches every page of the free frames, so that capturing into
+	// them does not take page faults (see also BMUSBCapture::set_lock_memory()).
+	void prefault();
+
+	// Adds <num_frames> new frames to the pool (paged in if <prefault>).
+	// Can be called while capturing; the pool is only locked to add them.
+	// Returns false if memory ran out (e.g. against RLIMIT_MEMLOCK after
+	// mlockall()) before all of them were added.
+	bool add_frames(size_t num_frames, bool prefault);
+
 private:
 	size_t frame_size;
 
@@ -112,6 +188,39 @@ private:
 	std::stack<std::unique_ptr<uint8_t[]>> freelist;  // All of size <frame_size>.
 };
 
+// A single-producer, single-consumer ring of decoded audio samples, for use
+// with BMUSBCapture::set_audio_ring_buffer(). Samples are signed 32-bit
+// (the card's 24-bit samples in the upper 24 bits), with all eight channels
+// interleaved; a "frame" below is one sample for each channel.
+class AudioRingBuffer {
+public:
+	static constexpr unsigned num_channels = 8;
+
+	// <capacity> is in frames, and is rounded up to a power of two.
+	explicit AudioRingBuffer(size_t capacity);
+
+	// Called from the capture side. If there is not room for all of
+	// the frames, the ones that do not fit are dropped (and counted).
+	void write(const int32_t *samples, size_t num_frames);
+
+	// Called from the consumer side. Returns the number of frames read.
+	size_t read(int32_t *samples, size_t max_frames);
+
+	// Called from the consumer side.
+	size_t frames_available() const
+	{
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_dropped_frames() const { return dropped_frames.load(std::memory_order_relaxed); }
+
+private:
+	std::unique_ptr<int32_t[]> samples;
+	size_t capacity;  // In frames; a power of two.
+	std::atomic<size_t> head{0}, tail{0};  // In frames; not wrapped.
+	std::atomic<uint64_t> dropped_frames{0};
+};
+
 // Represents an input mode you can tune a card to.
 struct VideoMode {
 	std::string name;
@@ -139,6 +248,90 @@ struct VideoFormat {
 	bool is_connected = true;  // If false, then has_signal makes no sense.
 };
 
+// Frames (and their bytes) that were thrown away because the frame
+// allocator had no free frames, ie., because the consumer fell behind.
+struct DroppedFrameStats {
+	uint64_t video_frames = 0, video_bytes = 0;
+	uint64_t audio_frames = 0, audio_bytes = 0;
+};
+
+// How quickly capture settled after the video mode last changed (see
+// BMUSBCapture::get_mode_change_stats()). A mode is locked once the first
+// frame in it has come through complete, with exactly the expected length;
+// the time is counted from the first frame header in the new mode.
+struct ModeChangeStats {
+	uint64_t mode_changes = 0;
+	bool locked = true;  // False while waiting for the latest mode to lock.
+	std::chrono::nanoseconds last_time_to_lock{0}, max_time_to_lock{0};
+
+	// Video packets that came back with errors (typically overflows,
+	// from transfers still laid out for the old mode) while waiting
+	// for the latest mode to lock.
+	uint64_t last_errored_packets = 0;
+};
+
+// How capture has recovered from USB errors (see BMUSBCapture::get_recovery_stats()).
+// A recovery cancels all transfers, resets the interface's alternate setting,
+// resubmits the transfers and resyncs to the stream; its time counts from the
+// error until the first frame header after that.
+struct RecoveryStats {
+	uint64_t recoveries = 0;  // Completed.
+	uint64_t failed_recoveries = 0;  // Gave up; the card is treated as disconnected.
+	bool recovering = false;
+	std::chrono::nanoseconds last_recovery_time{0}, max_recovery_time{0};
+
+	// What started the last recovery: a libusb_transfer_status (positive)
+	// if a transfer came back bad, or a libusb_error (negative) if one
+	// could not be resubmitted.
+	int last_error = 0;
+};
+
+// Where the time went from configure_card() until the first frame reached
+// the frame callback (see BMUSBCapture::get_startup_stats()). The phases
+// follow each other, except that the application's own time between
+// configure_card() and start_bm_capture() only counts in the total.
+// Phases that have not ended yet are zero.
+struct StartupStats {
+	bool complete = false;  // The first frame has been delivered.
+	std::chrono::nanoseconds create_frame_pools{0};
+	std::chrono::nanoseconds libusb_init{0};
+	std::chrono::nanoseconds open_card{0};  // Including enumerating the bus.
+	std::chrono::nanoseconds set_interface{0};  // Configuration, interface and alternate settings.
+	std::chrono::nanoseconds control_transfers{0};  // Capture mode and the initial requests.
+	std::chrono::nanoseconds allocate_transfers{0};
+	std::chrono::nanoseconds finish_configure{0};  // Waiting for frame_pool_warmup, starting threads, locking memory.
+	std::chrono::nanoseconds submit_transfers{0};  // In start_bm_capture().
+	std::chrono::nanoseconds first_header{0};  // Until the first frame started coming in.
+	std::chrono::nanoseconds first_frame{0};  // Until it was complete and reached the frame callback.
+	std::chrono::nanoseconds time_to_first_frame{0};
+
+	// Paging in the initial frames, in the background from create_frame_pools
+	// on; configure_card() waits for it at the end if need be.
+	std::chrono::nanoseconds frame_pool_warmup{0};
+};
+
+// Statistics about the isochronous packets that have come back from one
+// endpoint (see BMUSBCapture::get_video_packet_stats()). The average fill
+// is bytes / requested_bytes.
+struct PacketStats {
+	uint64_t packets = 0;
+	uint64_t full_packets = 0;  // Came back with as many bytes as we asked for.
+	uint64_t errored_packets = 0;  // Any status but completed, including overflows.
+	uint64_t overflowed_packets = 0;  // The card sent more than we asked for.
+	uint64_t bytes = 0, requested_bytes = 0;  // Sums of actual and requested lengths.
+	size_t max_packet_bytes = 0;  // Largest packet since the video mode last changed.
+	size_t packet_size = 0;  // How many bytes we currently ask for per packet.
+};
+
+// A copy of the card's register file, as of the last completed read pass
+// (see BMUSBCapture::set_register_poll_interval()).
+struct RegisterSnapshot {
+	static constexpr int NUM_REGISTERS = 60;  // In bytes; read four at a time.
+	uint8_t registers[NUM_REGISTERS] = {0};
+	uint64_t passes = 0;  // Completed read passes so far; 0 means no data yet.
+	std::chrono::steady_clock::time_point read_at;  // When the last pass completed.
+};
+
 struct AudioFormat {
 	uint16_t id = 0;  // For debugging/logging only.
 	unsigned bits_per_sample = 0;
@@ -188,6 +381,34 @@ enum PixelFormat {
 	PixelFormat_Unused127 = 127
 };
 
+// Formats that video can be converted to while frames are being assembled
+// (see BMUSBCapture::set_output_pixel_format()). All of them can be made
+// from both 8- and 10-bit input. <W> and <H> below are the width and height
+// of the delivered picture; the planes follow each other directly, without
+// any padding, right after the header.
+enum OutputPixelFormat {
+	// No conversion; whatever the card sends (see PixelFormat).
+	// This is the default.
+	OutputPixelFormat_Native,
+
+	// 8-bit 4:2:2 in Y Cb Y Cr order (YUYV); stride is W * 2.
+	OutputPixelFormat_YUYV,
+
+	// 8-bit 4:2:0; a W x H Y' plane followed by a W x H/2 plane of
+	// interleaved Cb and Cr (NV12). Stride is W. Chroma is taken from
+	// the first line of each pair of lines.
+	OutputPixelFormat_NV12,
+
+	// 8-bit 4:2:0; a W x H Y' plane followed by W/2 x H/2 Cb and Cr
+	// planes (I420). Stride is W. Chroma is taken like for NV12.
+	OutputPixelFormat_I420,
+
+	// 4:2:2 with each sample in a 16-bit little-endian int, holding
+	// a 10-bit value (8-bit input is shifted up); a W x H Y' plane followed
+	// by W/2 x H Cb and Cr planes. Stride is W * 2 (in bytes).
+	OutputPixelFormat_Planar16
+};
+
 typedef std::function<void(uint16_t timecode,
                            FrameAllocator::Frame video_frame, size_t video_offset, VideoFormat video_format,
                            FrameAllocator::Frame audio_frame, size_t audio_offset, AudioFormat audio_format)>
@@ -196,6 +417,55 @@ typedef std::function<void(uint16_t timecode,
 typedef std::function<void(libusb_device *dev)> card_connected_callback_t;
 typedef std::function<void()> card_disconnected_callback_t;
 
+enum LogLevel {
+	LogLevel_Debug,
+	LogLevel_Info,
+	LogLevel_Warning,
+	LogLevel_Error
+};
+
+// Which of a card's threads to schedule (see BMUSBCapture::set_thread_scheduling()).
+enum BMUSBThread {
+	BMUSBThread_USB,
+	BMUSBThread_Decode,
+	BMUSBThread_Dequeue
+};
+
+struct ThreadScheduling {
+	int policy = SCHED_OTHER;  // SCHED_OTHER, SCHED_FIFO or SCHED_RR.
+	int priority = 0;  // Only for SCHED_FIFO and SCHED_RR.
+	std::vector<int> cpus;  // Which CPUs to run on; empty for any.
+};
+
+enum BMUSBErrorCode {
+	BMUSBError_LibusbInit,
+	BMUSBError_NoSuchCard,
+	BMUSBError_Open,
+	BMUSBError_Configure,  // Setting the configuration, interface or alternate setting.
+	BMUSBError_Control,  // A control request to the card.
+	BMUSBError_OutOfMemory,
+	BMUSBError_Submit,
+	BMUSBError_Hotplug
+};
+
+// Thrown when setting up a card (or changing its mode) fails. Errors once
+// capture is running are recovered from instead; see get_recovery_stats().
+class BMUSBError : public std::runtime_error {
+public:
+	BMUSBError(BMUSBErrorCode code, int libusb_error, const std::string &message)
+		: std::runtime_error(message), error_code(code), libusb_error_code(libusb_error) {}
+
+	BMUSBErrorCode code() const { return error_code; }
+	int libusb_error() const { return libusb_error_code; }  // 0 if none.
+
+private:
+	BMUSBErrorCode error_code;
+	int libusb_error_code;
+};
+
+// Gets one log message at a time, as a single line without the newline.
+typedef std::function<void(LogLevel level, const char *message)> log_callback_t;
+
 class CaptureInterface {
  public:
 	virtual ~CaptureInterface() {}
@@ -249,11 +519,8 @@ class CaptureInterface {
 // The actual capturing class, representing capture from a single card.
 class BMUSBCapture : public CaptureInterface {
  public:
-	BMUSBCapture(int card_index, libusb_device *dev = nullptr)
-		: card_index(card_index), dev(dev)
-	{
-	}
-
+	// Both out of line, since some of the members are only declared here.
+	BMUSBCapture(int card_index, libusb_device *dev = nullptr);
 	~BMUSBCapture();
 
 	// Note: Cards could be unplugged and replugged between this call and
@@ -355,6 +622,344 @@ class BMUSBCapture : public CaptureInterface {
 		hotplug_existing_devices = hotplug_existing_devices_arg;
 	}
 
+	// Log messages from the capture threads never do any I/O there; they are
+	// put on a fixed-size lock-free ring and passed on from a separate logging
+	// thread, to the callback set here, or if none, printed to stdout (debug
+	// and info) or stderr (warnings and errors). Messages that can come in
+	// floods (e.g. for every bad packet) get through at most once a second,
+	// with a count of how many were held back. If the logging thread cannot
+	// keep up, messages are dropped, and the loss reported later.
+	//
+	// The callback is called from the logging thread only, and can be
+	// changed at any time, from any thread. nullptr goes back to printing.
+	static void set_log_callback(log_callback_t callback);
+
+	// Messages below this level are thrown away before being formatted.
+	// The default is LogLevel_Debug, ie., everything.
+	static void set_log_level(LogLevel level);
+
+	// If enabled, video frames are not copied out of the USB transfer
+	// buffers; instead, each frame is delivered as a list of spans
+	// pointing directly into them (see FrameAllocator::Frame::spans),
+	// and the transfers are held back from resubmission until the frame
+	// is released. This saves a full copy of every frame for consumers that
+	// need to convert or encode the data anyway. <max_held_frames> is how
+	// many frames can be queued or held by the consumer at any given time;
+	// enough extra transfers are allocated to cover them. This replaces
+	// any video frame allocator you have set.
+	//
+	// Needs to be run before configure_card().
+	void set_zero_copy_video(bool enable, unsigned max_held_frames = 4)
+	{
+		zero_copy_video = enable;
+		zero_copy_max_held_frames = max_held_frames;
+	}
+
+	// If enabled, the USB callbacks only hand completed transfers over to
+	// a separate decode thread (through a lock-free queue), which then
+	// does all the parsing and copying and resubmits the transfers.
+	// This keeps the time spent in the realtime USB thread very short,
+	// at the cost of some extra transfers in the pool and a thread handoff.
+	//
+	// Needs to be run before configure_card().
+	void set_decode_thread_enabled(bool enable)
+	{
+		use_decode_thread = enable;
+	}
+
+	// If enabled, the card gets its own libusb context, and its own thread
+	// to handle USB events (started by start_bm_capture()), instead of
+	// sharing the one from start_bm_thread() with every other card. Then
+	// several cards on separate controllers can run on separate cores, and
+	// one card can be shut down (destroyed) without stopping the others.
+	// If <cpus> is not empty, the thread only runs on those CPUs.
+	// start_bm_thread() is still needed for hotplug.
+	//
+	// Needs to be run before configure_card().
+	void set_own_usb_context(bool enable, const std::vector<int> &cpus = {})
+	{
+		own_usb_context = enable;
+		usb_thread_scheduling.cpus = cpus;
+	}
+
+	// How to schedule the card's threads. BMUSBThread_USB is the card's own
+	// USB thread (see set_own_usb_context()); the one shared between cards
+	// is set with set_shared_usb_thread_scheduling(), before start_bm_thread().
+	// USB threads default to SCHED_RR at priority 1, the others to normal
+	// scheduling. If the policy cannot be set (typically for lack of
+	// CAP_SYS_NICE or RLIMIT_RTPRIO), a warning is logged, and the thread
+	// runs with what it has.
+	//
+	// Needs to be run before configure_card().
+	void set_thread_scheduling(BMUSBThread thread, const ThreadScheduling &scheduling)
+	{
+		switch (thread) {
+		case BMUSBThread_USB:
+			usb_thread_scheduling = scheduling;
+			break;
+		case BMUSBThread_Decode:
+			decode_thread_scheduling = scheduling;
+			break;
+		case BMUSBThread_Dequeue:
+			dequeue_thread_scheduling = scheduling;
+			break;
+		}
+	}
+
+	static void set_shared_usb_thread_scheduling(const ThreadScheduling &scheduling)
+	{
+		shared_usb_thread_scheduling = scheduling;
+	}
+
+	// If enabled, configure_card() locks all of the process' memory, current
+	// and future (mlockall()), once the frame pools and transfers are
+	// allocated, so that capture never waits for a page fault. If that is
+	// not allowed (see RLIMIT_MEMLOCK), it logs a warning, and just makes
+	// sure that the frames in the pools it made itself are paged in.
+	//
+	// Needs to be run before configure_card().
+	void set_lock_memory(bool enable)
+	{
+		lock_memory = enable;
+	}
+
+	// If enabled, no thread is started to handle the card's USB events
+	// (this implies set_own_usb_context(true)); instead, the application
+	// drives them from its own event loop. Poll (or epoll) the file
+	// descriptors from get_pollfds(), following any changes through
+	// set_pollfd_notifiers(); wake up no later than get_next_timeout()
+	// says; and call process_events() whenever either happens. The transfer
+	// callbacks all run on that thread, so it needs to stay responsive
+	// (see also set_decode_thread_enabled()).
+	//
+	// Needs to be run before configure_card().
+	void set_external_event_loop(bool enable)
+	{
+		external_event_loop = enable;
+		if (enable) {
+			own_usb_context = true;
+		}
+	}
+
+	// For set_external_event_loop(); only valid after configure_card().
+	// The file descriptors are to be polled for the given events
+	// (POLLIN, POLLOUT).
+	std::vector<libusb_pollfd> get_pollfds() const;
+	void set_pollfd_notifiers(std::function<void(int fd, short events)> added,
+	                          std::function<void(int fd)> removed);
+
+	// Returns false if there is no deadline right now (which is always
+	// the case on Linux, where libusb has a file descriptor for timeouts).
+	bool get_next_timeout(std::chrono::microseconds *timeout) const;
+
+	// Handles whatever USB events are ready, without blocking.
+	// Returns a libusb error code (LIBUSB_SUCCESS if none).
+	int process_events();
+
+	// How many isochronous transfers to keep in flight for each endpoint,
+	// and how large each video transfer is (rounded up to a multiple of
+	// 32 kB). More transfers means more slack before packets are lost
+	// when the machine is busy, at the cost of memory. The defaults are
+	// six of each, and 128 kB. Options that hold on to transfers for
+	// longer (see set_decode_thread_enabled() and set_zero_copy_video())
+	// add more on top of this.
+	//
+	// Needs to be run before configure_card().
+	void set_transfer_ring_depth(unsigned num_video_transfers, unsigned num_audio_transfers,
+	                             size_t video_transfer_size = 128 << 10)
+	{
+		this->num_video_transfers = std::max(num_video_transfers, 2u);
+		this->num_audio_transfers = std::max(num_audio_transfers, 2u);
+		this->video_transfer_size = (std::max<size_t>(video_transfer_size, 1) + 32767) & ~size_t(32767);
+	}
+
+	// If enabled, the number of video transfers in flight is adjusted
+	// at runtime, based on how long transfers are kept between completion
+	// and resubmit and on whether any packets come back with errors.
+	// It will never go below what was given to set_transfer_ring_depth(),
+	// nor above that plus <max_extra_video_transfers>, which are all
+	// allocated up front.
+	//
+	// Needs to be run before configure_card().
+	void set_adaptive_transfer_ring_depth(bool enable, unsigned max_extra_video_transfers = 26)
+	{
+		adaptive_transfers = enable;
+		this->max_extra_video_transfers = max_extra_video_transfers;
+	}
+
+	// If set, audio is decoded straight into the given ring buffer instead
+	// of being delivered in audio frames. The audio frames given to the
+	// frame callback will then always be empty (but the AudioFormat is
+	// still filled in). Any audio frame allocator is replaced by one that
+	// only hands out empty frames, so get_audio_frame_allocator() can still
+	// be given back the audio frames as usual. Does not take ownership.
+	//
+	// Needs to be run before configure_card().
+	void set_audio_ring_buffer(AudioRingBuffer *ring)
+	{
+		audio_ring_buffer = ring;
+	}
+
+	// Only deliver every <n>th video frame; e.g., 2 gives 25 fps from
+	// a 50p source. The other frames are never allocated or copied.
+	// They still show up in the frame callback, with an empty video frame
+	// but with their audio, so that timecodes stay continuous and no audio
+	// is lost. (Custom allocators must thus accept empty frames in
+	// release_frame().) Frames without signal are never skipped.
+	// 1 (the default) delivers every frame.
+	//
+	// Can be changed at any time.
+	void set_frame_decimation(unsigned n)
+	{
+		frame_decimation = std::max(n, 1u);
+	}
+
+	// Crop video frames to the given rectangle while they are being
+	// assembled, so that only those pixels are copied, and the frame
+	// delivered to the callback holds the header followed by exactly
+	// the cropped picture. Lines are counted from the top of the active
+	// picture (ie., after extra_lines_top), and pixels from the left;
+	// a count of zero means "until the end". Thus, set_video_crop(0, 0)
+	// gives the active picture without any blanking.
+	//
+	// Pixel values are rounded down to what the pixel format can be split
+	// on (2 pixels for 8-bit, 6 for 10-bit), and for interlaced formats,
+	// line values are rounded down to even numbers so that both fields
+	// are cropped the same way. The VideoFormat given to the frame callback
+	// describes the cropped frame (no extra lines, new width, height and
+	// stride, which is no longer padded for 10-bit). For zero-copy video
+	// (see set_zero_copy_video()), only the line range is used, since
+	// cropping each line would need a span per line.
+	//
+	// Needs to be run before configure_card().
+	void set_video_crop(unsigned first_line, unsigned num_lines,
+	                    unsigned first_pixel = 0, unsigned num_pixels = 0)
+	{
+		video_crop_enabled = true;
+		crop_first_line = first_line;
+		crop_num_lines = num_lines;
+		crop_first_pixel = first_pixel;
+		crop_num_pixels = num_pixels;
+	}
+
+	// For interlaced formats, only capture field 1 or field 2 (0, the
+	// default, captures both). The field is delivered as a progressive
+	// frame of half the height, without any blanking, and the other field
+	// is never copied. Progressive formats are not affected. If combined
+	// with set_video_crop(), lines are still counted in frame lines.
+	//
+	// Needs to be run before configure_card().
+	void set_single_field_capture(unsigned field)
+	{
+		assert(field <= 2);
+		capture_field = field;
+	}
+
+	// Convert video to the given format while frames are being assembled,
+	// instead of delivering what the card sends, so that consumers don't
+	// need a second pass over every frame. This implies cropping to the
+	// active picture (see set_video_crop(), which can still be used to
+	// crop further), and the VideoFormat given to the frame callback
+	// describes the converted picture; see OutputPixelFormat for the
+	// layouts. Frames are always written to <data> (interleaved and
+	// data_copy are ignored), and zero-copy video (see
+	// set_zero_copy_video()) is never converted. Neither are frames
+	// without signal, or in a mode we don't know the layout of;
+	// FrameMetadata::converted tells which frames were.
+	//
+	// Needs to be run before configure_card().
+	void set_output_pixel_format(OutputPixelFormat format)
+	{
+		output_pixel_format = format;
+	}
+
+	// Can be called from any thread.
+	DroppedFrameStats get_dropped_frame_stats() const
+	{
+		DroppedFrameStats stats;
+		stats.video_frames = video_sync.dropped_frames.load(std::memory_order_relaxed);
+		stats.video_bytes = video_sync.dropped_bytes.load(std::memory_order_relaxed);
+		stats.audio_frames = audio_sync.dropped_frames.load(std::memory_order_relaxed);
+		stats.audio_bytes = audio_sync.dropped_bytes.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	// Can be called from any thread.
+	ModeChangeStats get_mode_change_stats() const
+	{
+		ModeChangeStats stats;
+		stats.mode_changes = mode_changes.load(std::memory_order_relaxed);
+		stats.locked = mode_locked.load(std::memory_order_relaxed);
+		stats.last_time_to_lock = std::chrono::nanoseconds(last_time_to_lock_ns.load(std::memory_order_relaxed));
+		stats.max_time_to_lock = std::chrono::nanoseconds(max_time_to_lock_ns.load(std::memory_order_relaxed));
+		stats.last_errored_packets = mode_change_errored_packets.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	// If enabled, the size of the video packets is tuned at runtime to the
+	// smallest size that the card's packets fit into in the current mode,
+	// instead of the conservative defaults, which means less memory touched
+	// per transfer and less bus time reserved (which matters with several
+	// cards on one controller). After a mode change, it starts over from the
+	// default, and shrinks once it has seen a while of traffic; if a packet
+	// ever overflows, it goes back to the default, and never tries that small
+	// a size again until the mode changes. With zero-copy video, packets are
+	// kept to at least a sixteenth of a transfer, since each needs its own span.
+	//
+	// Needs to be run before configure_card().
+	void set_auto_packet_size(bool enable)
+	{
+		auto_packet_size = enable;
+	}
+
+	// Can be called from any thread.
+	RecoveryStats get_recovery_stats() const
+	{
+		RecoveryStats stats;
+		stats.recoveries = recoveries.load(std::memory_order_relaxed);
+		stats.failed_recoveries = failed_recoveries.load(std::memory_order_relaxed);
+		stats.recovering = recovering.load(std::memory_order_relaxed);
+		stats.last_recovery_time = std::chrono::nanoseconds(last_recovery_time_ns.load(std::memory_order_relaxed));
+		stats.max_recovery_time = std::chrono::nanoseconds(max_recovery_time_ns.load(std::memory_order_relaxed));
+		stats.last_error = last_recovery_error.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	// Can be called from any thread.
+	StartupStats get_startup_stats() const;
+
+	// Can be called from any thread.
+	PacketStats get_video_packet_stats() const;
+	PacketStats get_audio_packet_stats() const;
+
+	// The card's registers are read with asynchronous control transfers, one
+	// full pass (of four bytes at a time) at a time, alongside the capture.
+	// By default, this only happens when asked for with request_register_read();
+	// with a nonzero interval, a new pass is also started that long after the
+	// last one completed. Passes are started from the USB thread as the
+	// isochronous transfers come back, so the timing is only as precise
+	// as that (a millisecond or so while capturing).
+	//
+	// Can be called from any thread.
+	void set_register_poll_interval(std::chrono::milliseconds interval)
+	{
+		register_poll_interval_ms = interval.count();
+	}
+
+	// Starts a single read pass, unless one is running already.
+	// Can be called from any thread.
+	void request_register_read()
+	{
+		register_read_requested = true;
+	}
+
+	// Can be called from any thread, and never blocks.
+	RegisterSnapshot get_register_snapshot() const;
+
+	// Number of video transfers currently in circulation.
+	// Only changes at runtime if adaptive depth is enabled.
+	int get_num_active_video_transfers() const { return active_video_transfers; }
+
 	// Similar to set_card_connected_callback(), with the same caveats.
 	// (Note that this is set per-card and not global, as it is logically
 	// connected to an existing BMUSBCapture object.)
@@ -370,13 +975,210 @@ class BMUSBCapture : public CaptureInterface {
 		FrameAllocator::Frame frame;
 	};
 
+	// Where we are in the stream from one of the isochronous endpoints,
+	// relative to the sync patterns that separate the frames.
+	struct SyncState {
+		size_t bytes_since_sync = 0;
+
+		// Length of the frame in progress (counting from right after the
+		// sync pattern), if known from its format; 0 if not.
+		size_t expected_frame_bytes = 0;
+
+		// If true, expected_frame_bytes has been confirmed against the
+		// stream, so we can skip straight to the next sync pattern
+		// instead of searching for it.
+		bool locked = false;
+
+		// If nonzero, the last packet ended with this many bytes of what
+		// could be a sync pattern continuing into the next packet (or
+		// transfer). Those bytes have not been added to the frame yet.
+		size_t partial_sync_bytes = 0;
+
+		// If true, there was no free frame for the frame in progress
+		// (the consumer is falling behind), so we are just throwing away
+		// its data until the next sync. The counters are read from
+		// other threads, but only ever written from the USB thread.
+		bool dropping = false;
+		std::atomic<uint64_t> dropped_frames{0}, dropped_bytes{0};
+
+		void count_dropped_bytes(size_t bytes)
+		{
+			dropped_bytes.store(dropped_bytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+		}
+
+		// Called when the sync pattern has been found by searching.
+		void found_sync()
+		{
+			if (expected_frame_bytes != 0 && bytes_since_sync == expected_frame_bytes) {
+				locked = true;
+			}
+			bytes_since_sync = 0;
+		}
+
+		void set_expected_frame_bytes(size_t bytes)
+		{
+			if (bytes != expected_frame_bytes) {
+				expected_frame_bytes = bytes;
+				locked = false;
+			}
+		}
+	};
+
+	// Bookkeeping for each of the isochronous transfers;
+	// their user_data points to this.
+	struct TransferState {
+		BMUSBCapture *card = nullptr;
+		libusb_transfer *xfr = nullptr;
+
+		// The transfer is resubmitted when this reaches zero. We hold one
+		// reference while decoding it, and each zero-copy frame that
+		// points into its buffer holds another one.
+		std::atomic<int> refcount{0};
+
+		// Set when the transfer comes back from the card; the sequence
+		// number counts transfers per endpoint (see FrameMetadata).
+		std::chrono::steady_clock::time_point completed_at;
+		uint64_t sequence = 0;
+
+		bool parked = false;  // Taken out of circulation (adaptive depth only).
+
+		// Which video_xfr_layout_generation the iso packets are laid out for.
+		unsigned layout_generation = 0;
+	};
+
+	class ZeroCopyFrameAllocator;
+
+	// A lock-free single-producer, single-consumer queue of completed
+	// transfers, from the USB thread to the decode thread. Each transfer
+	// can only be in it once (it is not resubmitted until it has been
+	// decoded), so it is sized to hold all of them and can never overflow.
+	class CompletedTransferQueue {
+	public:
+		void init(size_t max_elements)
+		{
+			size_t size = 1;
+			while (size < max_elements) size *= 2;
+			elements.resize(size);
+		}
+
+		// Only from the USB thread.
+		void push(TransferState *xfr_state)
+		{
+			size_t h = head.load(std::memory_order_relaxed);
+			assert(h - tail.load(std::memory_order_acquire) < elements.size());
+			elements[h & (elements.size() - 1)] = xfr_state;
+			head.store(h + 1, std::memory_order_release);
+		}
+
+		// Only from the decode thread. Returns nullptr if empty.
+		TransferState *pop()
+		{
+			size_t t = tail.load(std::memory_order_relaxed);
+			if (t == head.load(std::memory_order_acquire)) {
+				return nullptr;
+			}
+			TransferState *xfr_state = elements[t & (elements.size() - 1)];
+			tail.store(t + 1, std::memory_order_release);
+			return xfr_state;
+		}
+
+	private:
+		std::vector<TransferState *> elements;
+		std::atomic<size_t> head{0}, tail{0};
+	};
+
+	// Which bytes of a video frame to keep when cropping (see set_video_crop()),
+	// as offsets from the start of the frame (ie., including the header,
+	// which is always kept).
+	struct FrameCrop {
+		// Ranges of lines to keep; interlaced formats have one per field.
+		size_t region_start[2], region_end[2];
+		unsigned num_regions;
+
+		size_t line_stride;  // In the source.
+		size_t line_offset, line_bytes;  // Which part of each line to keep.
+
+		// Calls store(start, end, line, column) for each part of [from, to)
+		// that is to be kept, given that <from> is <pos> bytes into the frame.
+		// <line> is the line in the cropped frame, and <column> is how many
+		// bytes into the kept part of that line <start> is. Parts of the
+		// header are given as line <header_line>, with <column> counted
+		// from the start of the frame.
+		static constexpr size_t header_line = size_t(-1);
+		template<class Store>
+		void for_each_kept(size_t pos, const uint8_t *from, const uint8_t *to, Store store) const;
+	};
+
+	// Works out <frame_crop> (if not nullptr) for a frame in the given format,
+	// and changes the format to describe the cropped frame. Returns false
+	// (and does nothing) if frames in this format should not be cropped.
+	// Also handles single-field capture, which is cropping to one field.
+	bool compute_frame_crop(VideoFormat *video_format, FrameCrop *frame_crop) const;
+
+	// Called at the start of every frame with the format of the new frame
+	// (and its expected length, or 0 if unknown), before anything is reset
+	// for it. Keeps track of mode changes and re-lays out the transfers.
+	void update_video_mode(const VideoFormat &video_format, size_t expected_frame_bytes);
+
+	// Called at the start of every frame, after allocating it.
+	void update_drop_state(SyncState *sync, bool dropping, const char *frame_type_name);
+
 	void start_new_audio_block(const uint8_t *start);
 	void start_new_frame(const uint8_t *start);
+	void release_transfer(TransferState *xfr_state);
+	void submit_transfer(TransferState *xfr_state);
+	void update_video_transfer_depth(int num_errors);
+	void decode_transfer(TransferState *xfr_state);
+	void maybe_start_register_read(std::chrono::steady_clock::time_point now);
+	void register_read_done(libusb_transfer *xfr);
+	void submit_register_read();
+	void decode_thread_func();
+	void stop_decode_thread();
+	void request_recovery(int error);
+	void recovery_thread_func();
+	bool recover_from_error();
+	void resync_after_recovery();
+	int send_capture_mode();
+	void warmup_thread_func();
+
+	// Calls decode_packs() directly; see bench.cpp.
+	friend struct BMUSBCaptureBenchmark;
+
+	// Describe the two isochronous endpoints (sync patterns etc.)
+	// for decode_packs().
+	struct AudioEndpoint;
+	struct VideoEndpoint;
+
+	// What decode_packs() saw of the packets in one transfer.
+	struct PacketCounts {
+		unsigned packets = 0, full_packets = 0, errored_packets = 0, overflowed_packets = 0;
+		size_t bytes = 0, requested_bytes = 0, max_packet_bytes = 0;
+	};
+
+	// Running totals of PacketCounts, for get_video_packet_stats() etc.
+	// Only written from the thread that decodes, but can be read from anywhere.
+	struct PacketCounters {
+		std::atomic<uint64_t> packets{0}, full_packets{0}, errored_packets{0}, overflowed_packets{0};
+		std::atomic<uint64_t> bytes{0}, requested_bytes{0};
+		std::atomic<size_t> max_packet_bytes{0};
+
+		void add(const PacketCounts &counts);
+		PacketStats get() const;
+	};
+
+	// Also adds the packets to the endpoint's PacketCounters.
+	template<class Endpoint>
+	void decode_packs(TransferState *xfr_state, PacketCounts *counts);
+
+	// See set_auto_packet_size().
+	void tune_video_packet_size(const PacketCounts &counts);
+	void set_video_packet_size(size_t size);
 
 	void queue_frame(uint16_t format, uint16_t timecode, FrameAllocator::Frame frame, std::deque<QueuedFrame> *q);
 	void dequeue_thread_func();
 
 	static void usb_thread_func();
+	void card_usb_thread_func();
 	static void cb_xfr(struct libusb_transfer *xfr);
 	static int cb_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data);
 
@@ -385,7 +1187,11 @@ class BMUSBCapture : public CaptureInterface {
 	std::string description;
 
 	FrameAllocator::Frame current_video_frame;
+	bool current_video_frame_skipped = false;  // See set_frame_decimation().
+	bool current_video_frame_cropped = false;
+	FrameCrop current_video_crop;  // If current_video_frame_cropped.
 	FrameAllocator::Frame current_audio_frame;
+	SyncState video_sync, audio_sync;
 
 	std::mutex queue_lock;
 	std::condition_variable queues_not_empty;
@@ -396,6 +1202,24 @@ class BMUSBCapture : public CaptureInterface {
 	FrameAllocator *audio_frame_allocator = nullptr;
 	std::unique_ptr<FrameAllocator> owned_video_frame_allocator;
 	std::unique_ptr<FrameAllocator> owned_audio_frame_allocator;
+	bool video_crop_enabled = false;
+	unsigned crop_first_line = 0, crop_num_lines = 0;
+	unsigned crop_first_pixel = 0, crop_num_pixels = 0;
+	unsigned capture_field = 0;  // See set_single_field_capture().
+	OutputPixelFormat output_pixel_format = OutputPixelFormat_Native;
+	class FrameConverter;
+	std::unique_ptr<FrameConverter> frame_converter;  // Only if converting.
+	std::atomic<unsigned> frame_decimation{1};
+	unsigned decimation_phase = 0;  // USB thread only.
+	AudioRingBuffer *audio_ring_buffer = nullptr;
+	class AudioBlockDecoder;
+	class EmptyFrameAllocator;
+	std::unique_ptr<AudioBlockDecoder> audio_decoder;  // Only if audio_ring_buffer != nullptr.
+	std::atomic<size_t> last_audio_block_len{0};  // Including the header.
+	std::atomic<uint16_t> last_audio_format{0};
+	bool zero_copy_video = false;
+	unsigned zero_copy_max_held_frames = 4;
+	ZeroCopyFrameAllocator *zero_copy_allocator = nullptr;  // Owned by owned_video_frame_allocator.
 	frame_callback_t frame_callback = nullptr;
 	static card_connected_callback_t card_connected_callback;
 	static bool hotplug_existing_devices;
@@ -407,10 +1231,78 @@ class BMUSBCapture : public CaptureInterface {
 	std::function<void()> dequeue_init_callback = nullptr;
 	std::function<void()> dequeue_cleanup_callback = nullptr;
 
+	bool use_decode_thread = false;
+	std::thread decode_thread;
+	std::atomic<bool> decode_thread_should_quit{false};
+	CompletedTransferQueue completed_xfrs;
+	sem_t completed_xfrs_sem;  // Counts the elements in completed_xfrs.
+	bool completed_xfrs_sem_initialized = false;  // Only destroyed once the USB thread cannot post to it.
+
+	// For recovering from transfer errors; see recover_from_error().
+	// While recovering, transfers that would be submitted are set aside in
+	// idle_xfrs instead; the recovery thread submits them again when done.
+	std::atomic<bool> recovering{false};
+	std::atomic<int> xfrs_in_flight{0};  // Isochronous only.
+	std::thread recovery_thread;
+	std::mutex recovery_mutex;  // Protects recovery_requested, idle_xfrs and clearing <recovering>.
+	std::condition_variable recovery_cv;
+	bool recovery_requested = false;
+	std::atomic<bool> recovery_thread_should_quit{false};
+	std::vector<TransferState *> idle_xfrs;
+	std::atomic<unsigned> recovery_generation{0};
+	unsigned decoded_recovery_generation = 0;  // Only used from the thread that decodes.
+	bool awaiting_frame_after_recovery = false;  // Same.
+	std::atomic<int64_t> recovery_start_ns{0};  // steady_clock.
+	std::atomic<uint64_t> recoveries{0}, failed_recoveries{0};
+	std::atomic<int64_t> last_recovery_time_ns{0}, max_recovery_time_ns{0};
+	std::atomic<int> last_recovery_error{0};
+
+	// For fast startup; see warmup_thread_func(). frame_pools_warm and
+	// first_frame_delivered are protected by warmup_mutex.
+	std::thread warmup_thread;
+	std::mutex warmup_mutex;
+	std::condition_variable warmup_cv;
+	bool frame_pools_warm = false, first_frame_delivered = false;
+	std::atomic<bool> warmup_thread_should_quit{false};
+
+	// For get_startup_stats(); the steady_clock times (in nanoseconds)
+	// at which each phase of startup ended, or zero if it has not yet.
+	enum StartupMilestone {
+		Startup_Begin,
+		Startup_FramePoolsCreated,
+		Startup_LibusbInit,
+		Startup_CardOpened,
+		Startup_InterfaceSet,
+		Startup_ControlTransfersDone,
+		Startup_TransfersAllocated,
+		Startup_Configured,
+		Startup_SubmitBegin,
+		Startup_Submitted,
+		Startup_FirstHeader,
+		Startup_FirstFrame,
+		Startup_FramePoolsWarm,
+		NUM_STARTUP_MILESTONES
+	};
+	std::atomic<int64_t> startup_ns[NUM_STARTUP_MILESTONES] = {};
+	void mark_startup(StartupMilestone milestone);
+
+	// For the register reads (see set_register_poll_interval()). The transfer
+	// and the working copy are only touched from the USB thread; each completed
+	// pass is published through a seqlock, where an odd sequence number means
+	// that the USB thread is in the middle of writing.
+	static constexpr int NUM_BMUSB_REGISTERS = RegisterSnapshot::NUM_REGISTERS;
+	libusb_transfer *register_xfr = nullptr;
+	uint8_t register_xfr_buf[LIBUSB_CONTROL_SETUP_SIZE + 4];
+	std::atomic<bool> register_read_in_flight{false};  // Also read by the recovery thread.
 	int current_register = 0;
-
-	static constexpr int NUM_BMUSB_REGISTERS = 60;
 	uint8_t register_file[NUM_BMUSB_REGISTERS];
+	std::chrono::steady_clock::time_point next_register_read;
+	std::atomic<int64_t> register_poll_interval_ms{0};
+	std::atomic<bool> register_read_requested{false};
+	std::atomic<uint32_t> register_snapshot_seq{0};
+	std::atomic<uint32_t> register_snapshot_words[NUM_BMUSB_REGISTERS / 4] = {};
+	std::atomic<uint64_t> register_snapshot_passes{0};
+	std::atomic<int64_t> register_snapshot_time_ns{0};
 
 	// If <dev> is nullptr, will choose device number <card_index> from the list
 	// of available devices on the system. <dev> is not used after configure_card()
@@ -419,7 +1311,70 @@ class BMUSBCapture : public CaptureInterface {
 	libusb_device *dev = nullptr;
 
 	std::vector<libusb_transfer *> iso_xfrs;
-	int assumed_frame_width = 1280;
+	std::vector<std::unique_ptr<TransferState>> iso_xfr_states;
+	unsigned num_video_transfers = 6, num_audio_transfers = 6;
+	size_t video_transfer_size = 128 << 10;
+
+	// For adaptive transfer ring depth; see update_video_transfer_depth().
+	bool adaptive_transfers = false;
+	unsigned max_extra_video_transfers = 26;
+	int min_active_video_transfers = 0;
+	std::atomic<int> active_video_transfers{0};
+	std::atomic<int> video_transfers_to_retire{0};
+	std::atomic<int64_t> max_resubmit_latency_ns{0};
+	std::mutex parked_video_xfrs_mutex;
+	std::vector<TransferState *> parked_video_xfrs;
+	std::chrono::steady_clock::time_point depth_window_start;
+	unsigned depth_window_completions = 0, depth_window_errors = 0;
+	unsigned calm_depth_windows = 0;
+
+	// The width that the video transfers are laid out for (see
+	// find_xfer_size_for_width()). The USB thread changes it when the
+	// video mode changes, and bumps the generation; submit_transfer()
+	// then lays out each transfer anew the next time it goes back to
+	// the card, whichever thread that happens on.
+	std::atomic<int> assumed_frame_width{1280};
+	std::atomic<size_t> video_packet_size{0};  // What assumed_frame_width gives, unless tuned.
+	std::atomic<unsigned> video_xfr_layout_generation{0};
+
+	PacketCounters video_packet_counters, audio_packet_counters;
+	uint64_t video_xfr_sequence = 0, audio_xfr_sequence = 0;  // USB thread only.
+
+	// For set_auto_packet_size(); only used from the thread that decodes.
+	bool auto_packet_size = false;
+	size_t min_tuned_packet_size = 0;  // Anything smaller has overflowed in this mode.
+	size_t tune_window_max_packet_bytes = 0;
+	unsigned tune_window_packets = 0;
+
+	// For get_mode_change_stats(). The rest is only used from the USB thread.
+	std::atomic<uint64_t> mode_changes{0};
+	std::atomic<bool> mode_locked{true};
+	std::atomic<int64_t> last_time_to_lock_ns{0}, max_time_to_lock_ns{0};
+	std::atomic<uint64_t> mode_change_errored_packets{0};
+	unsigned last_video_width = 0;
+	size_t last_video_frame_bytes = 0;
+	std::chrono::steady_clock::time_point mode_change_time;
+	uint64_t video_errored_packets = 0, errored_packets_at_mode_change = 0;
+
+	// For set_own_usb_context(). usb_ctx is nullptr (the default
+	// context, handled by the thread from start_bm_thread()) if not.
+	bool own_usb_context = false;
+	libusb_context *usb_ctx = nullptr;
+	std::thread card_usb_thread;
+	std::atomic<bool> card_usb_thread_should_quit{false};
+
+	// For set_thread_scheduling() and set_lock_memory().
+	ThreadScheduling usb_thread_scheduling{SCHED_RR, 1, {}};
+	ThreadScheduling decode_thread_scheduling, dequeue_thread_scheduling;
+	static ThreadScheduling shared_usb_thread_scheduling;
+	bool lock_memory = false;
+
+	// For set_external_event_loop().
+	bool external_event_loop = false;
+	std::function<void(int fd, short events)> pollfd_added_callback;
+	std::function<void(int fd)> pollfd_removed_callback;
+	static void cb_pollfd_added(int fd, short events, void *user_data);
+	static void cb_pollfd_removed(int fd, void *user_data);
 
 	libusb_device_handle *devh = nullptr;
 	uint32_t current_video_input = 0x00000000;  // HDMI/SDI.
@@ -1,4 +1,7 @@
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "bmusb/bmusb.h"
 
@@ -37,9 +40,104 @@ void check_frame_stability(uint16_t timecode,
 	usb->get_audio_frame_allocator()->release_frame(audio_frame);
 }
 
+void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [OPTION...]\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "      --usb-thread=SPEC      schedule the USB thread by SPEC (default rr:1)\n");
+	fprintf(stderr, "      --decode-thread=SPEC   use a separate decode thread, scheduled by SPEC\n");
+	fprintf(stderr, "      --dequeue-thread=SPEC  schedule the dequeue thread by SPEC\n");
+	fprintf(stderr, "      --lock-memory          lock all memory (mlockall) after setup\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "SPEC is POLICY[:PRIORITY][@CPU[,CPU...]], where POLICY is other, fifo or rr;\n");
+	fprintf(stderr, "e.g. fifo:50@2 for SCHED_FIFO at priority 50, only on CPU 2.\n");
+}
+
+bool parse_thread_scheduling(const char *spec, ThreadScheduling *scheduling)
+{
+	size_t policy_len = strcspn(spec, ":@");
+	string policy(spec, policy_len);
+	if (policy == "other") {
+		scheduling->policy = SCHED_OTHER;
+	} else if (policy == "fifo") {
+		scheduling->policy = SCHED_FIFO;
+	} else if (policy == "rr") {
+		scheduling->policy = SCHED_RR;
+	} else {
+		return false;
+	}
+	spec += policy_len;
+
+	scheduling->priority = 0;
+	if (*spec == ':') {
+		char *end;
+		scheduling->priority = strtol(spec + 1, &end, 10);
+		if (end == spec + 1) {
+			return false;
+		}
+		spec = end;
+	}
+
+	scheduling->cpus.clear();
+	if (*spec == '@') {
+		do {
+			char *end;
+			scheduling->cpus.push_back(strtol(spec + 1, &end, 10));
+			if (end == spec + 1) {
+				return false;
+			}
+			spec = end;
+		} while (*spec == ',');
+	}
+	return *spec == '\0';
+}
+
 int main(int argc, char **argv)
 {
+	static const option long_options[] = {
+		{ "usb-thread", required_argument, 0, 'u' },
+		{ "decode-thread", required_argument, 0, 'd' },
+		{ "dequeue-thread", required_argument, 0, 'q' },
+		{ "lock-memory", no_argument, 0, 'l' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
 	usb = new BMUSBCapture(0);  // First card.
+	for ( ;; ) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "h", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+		ThreadScheduling scheduling;
+		if ((c == 'u' || c == 'd' || c == 'q') && !parse_thread_scheduling(optarg, &scheduling)) {
+			fprintf(stderr, "Invalid thread scheduling '%s'\n", optarg);
+			exit(1);
+		}
+		switch (c) {
+		case 'u':
+			BMUSBCapture::set_shared_usb_thread_scheduling(scheduling);
+			break;
+		case 'd':
+			usb->set_decode_thread_enabled(true);
+			usb->set_thread_scheduling(BMUSBThread_Decode, scheduling);
+			break;
+		case 'q':
+			usb->set_thread_scheduling(BMUSBThread_Dequeue, scheduling);
+			break;
+		case 'l':
+			usb->set_lock_memory(true);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
 	usb->set_frame_callback(check_frame_stability);
 	usb->configure_card();
 	BMUSBCapture::start_bm_thread();
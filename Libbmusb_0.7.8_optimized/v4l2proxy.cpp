@@ -46,7 +46,9 @@ void frame_callback(uint16_t timecode,
 		fmt.fmt.pix.width = video_format.width;
 		fmt.fmt.pix.height = video_format.height;
 
-		// Chrome accepts YUYV, but not our native UYVY. We byteswap below.
+		// Chrome accepts YUYV, but not our native UYVY, so we ask
+		// bmusb to convert (see main()), and byteswap below whatever
+		// it did not convert (such as frames without signal).
 		fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
 
 		fmt.fmt.pix.field = V4L2_FIELD_NONE;
@@ -66,26 +68,27 @@ void frame_callback(uint16_t timecode,
 		}
 	}
 
-	if (video_frame.data != nullptr) {
+	if (video_frame.data != nullptr && video_frame.len > video_offset) {
 		uint8_t *origptr = video_frame.data + video_offset + video_format.extra_lines_top * video_format.stride;
+		size_t len = min<size_t>(video_frame.len - video_offset, video_format.stride * video_format.height);
+		if (!video_frame.metadata.converted) {
 #if __SSE2__
-		__m128i *ptr = (__m128i *)origptr;
-		for (unsigned i = 0; i < video_format.stride * video_format.height / 16; ++i) {
-			__m128i val = _mm_loadu_si128(ptr);
-			val = _mm_slli_epi16(val, 8) | _mm_srli_epi16(val, 8);
-			_mm_storeu_si128(ptr, val);
-			++ptr;
-		}
+			__m128i *ptr = (__m128i *)origptr;
+			for (unsigned i = 0; i < len / 16; ++i) {
+				__m128i val = _mm_loadu_si128(ptr);
+				val = _mm_slli_epi16(val, 8) | _mm_srli_epi16(val, 8);
+				_mm_storeu_si128(ptr, val);
+				++ptr;
+			}
 #else
-		uint8_t *ptr = origptr;
-		for (unsigned i = 0; i < video_format.stride * video_format.height / 4; ++i) {
-			swap(ptr[0], ptr[1]);
-			swap(ptr[2], ptr[3]);
-			ptr += 4;
-		}
+			uint8_t *ptr = origptr;
+			for (unsigned i = 0; i < len / 4; ++i) {
+				swap(ptr[0], ptr[1]);
+				swap(ptr[2], ptr[3]);
+				ptr += 4;
+			}
 #endif
-
-		size_t len = video_frame.len;
+		}
 		while (len > 0) {
 			ssize_t ret = write(video_fd, origptr, len);
 			if (ret == -1) {
@@ -116,6 +119,7 @@ int main(int argc, char **argv)
 
 	usb = new BMUSBCapture(0);  // First card.
 	usb->set_frame_callback(frame_callback);
+	usb->set_output_pixel_format(OutputPixelFormat_YUYV);
 	usb->configure_card();
 	BMUSBCapture::start_bm_thread();
 	usb->start_bm_capture();
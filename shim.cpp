@@ -26,9 +26,11 @@ extern "C" {
         }
     }
 
-    void configure_card(void* ptr, int v_input_index, uint32_t ignored) {
+    // Returns 1 on success. On failure, the card is torn down, and only
+    // stop_capture() (to free the handle) can be called on it afterwards.
+    int configure_card(void* ptr, int v_input_index, uint32_t ignored) {
         Wrapper* w = (Wrapper*)ptr;
-        if (!w || !w->cap) return;
+        if (!w || !w->cap) return 0;
         try {
             // configure_card() internally starts the 'dequeue_thread'
             w->cap->configure_card(); 
@@ -42,7 +44,44 @@ extern "C" {
             w->cap->set_audio_input(audio_id);
             // Mode 0 = Autodetect
             w->cap->set_video_mode(0);
-        } catch (...) {}
+            return 1;
+        } catch (const std::exception& e) {
+            std::cerr << "configure_card: " << e.what() << std::endl;
+        } catch (...) {
+            std::cerr << "configure_card: unknown error" << std::endl;
+        }
+        // Don't leave a half-configured card behind; its threads may
+        // already be running.
+        delete w->cap;
+        w->cap = nullptr;
+        return 0;
+    }
+
+    // Thread scheduling and memory locking; these must be called after
+    // init_card() and before configure_card(). <thread> is 0 for the USB
+    // thread, 1 for the decode thread and 2 for the dequeue thread; <policy>
+    // is SCHED_OTHER (0), SCHED_FIFO (1) or SCHED_RR (2); <cpu> is -1 for any.
+    void set_thread_scheduling(void* ptr, int thread, int policy, int priority, int cpu) {
+        Wrapper* w = (Wrapper*)ptr;
+        if (!w || !w->cap) return;
+        bmusb::ThreadScheduling scheduling;
+        scheduling.policy = policy;
+        scheduling.priority = priority;
+        if (cpu >= 0) scheduling.cpus.push_back(cpu);
+        if (thread == 0) {
+            // We use the USB thread shared between cards (start_bm_thread()).
+            bmusb::BMUSBCapture::set_shared_usb_thread_scheduling(scheduling);
+            w->cap->set_thread_scheduling(bmusb::BMUSBThread_USB, scheduling);
+        } else if (thread == 1) {
+            w->cap->set_thread_scheduling(bmusb::BMUSBThread_Decode, scheduling);
+        } else if (thread == 2) {
+            w->cap->set_thread_scheduling(bmusb::BMUSBThread_Dequeue, scheduling);
+        }
+    }
+
+    void set_lock_memory(void* ptr, int enable) {
+        Wrapper* w = (Wrapper*)ptr;
+        if (w && w->cap) w->cap->set_lock_memory(enable != 0);
     }
 
     void set_audio_callback(void* ptr, PythonAudioCallback cb) {
@@ -50,6 +89,13 @@ extern "C" {
         if (w) w->py_audio_cb = cb;
     }
 
+    // Keep only every n-th video frame (1 = all). Skipped frames are never
+    // copied; their audio still arrives through the audio callback.
+    void set_frame_decimation(void* ptr, unsigned n) {
+        Wrapper* w = (Wrapper*)ptr;
+        if (w && w->cap) w->cap->set_frame_decimation(n);
+    }
+
     int start_capture(void* ptr, PythonVideoCallback video_cb) {
         Wrapper* w = (Wrapper*)ptr;
         if (!w || !w->cap) return 0;
@@ -140,6 +186,9 @@ extern "C" {
             } catch (...) {
                 // Swallow errors during shutdown to avoid crash
             }
+        } else if (w) {
+            // configure_card() failed and already tore the card down.
+            delete w;
         }
     }
 }
@@ -124,9 +124,10 @@ extern "C" {
         return (void*)w;
     }
 
-    void configure_card(void* ptr, int v_input_index, uint32_t ignored) {
+    // Returns 1 on success, like the Linux shim.
+    int configure_card(void* ptr, int v_input_index, uint32_t ignored) {
         Wrapper* w = (Wrapper*)ptr;
-        if (!w || !w->deckLinkConfig) return;
+        if (!w || !w->deckLinkConfig) return 0;
 
         // Using constants defined in your generated header
         BMDVideoConnection conn = bmdVideoConnectionHDMI;
@@ -136,6 +137,7 @@ extern "C" {
 
         w->deckLinkConfig->SetInt(bmdDeckLinkConfigVideoInputConnection, (LONGLONG)conn);
         w->deckLinkConfig->SetInt(bmdDeckLinkConfigAudioInputConnection, (LONGLONG)bmdAudioConnectionEmbedded); 
+        return 1;
     }
 
     void set_audio_callback(void* ptr, PythonAudioCallback cb) {
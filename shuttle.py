@@ -65,6 +65,7 @@ try:
 
     _shim.init_card.restype = ctypes.c_void_p
     _shim.configure_card.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_uint32]
+    _shim.configure_card.restype = ctypes.c_int
     _shim.start_capture.argtypes = [ctypes.c_void_p, VideoCallbackFunc]
     _shim.set_audio_callback.argtypes = [ctypes.c_void_p, AudioCallbackFunc]
     _shim.stop_capture.argtypes = [ctypes.c_void_p]
@@ -392,9 +393,14 @@ class VhApp:
             
             try:
                 idx = INPUTS.index(self.cb_video.get())
-                _shim.configure_card(self.card, idx, 0)
             except:
-                _shim.configure_card(self.card, 0, 0)
+                idx = 0
+            if not _shim.configure_card(self.card, idx, 0):
+                # The shim has torn the card down; this just frees the handle.
+                _shim.stop_capture(self.card)
+                self.card = None
+                messagebox.showerror("Error", "Could not configure the card (see the console for details).")
+                return
 
             if _shim.start_capture(self.card, self.video_cb_ref):
                 self.connected = True